@@ -37,8 +37,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
@@ -50,6 +55,25 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <curl/curl.h>
 
+#if defined (__x86_64__) || defined (__i386__)
+#define USE_SSE2
+#include <emmintrin.h>
+#define SSE2_FN __attribute__ ((target ("sse2")))
+#endif
+
+#if defined (__aarch64__)
+#define USE_NEON
+#include <arm_neon.h>
+#define NEON_FN
+#elif defined (__arm__) && defined (__linux__) && !defined (__SOFTFP__)
+// armhf is built without NEON, so the NEON kernels are compiled for it on their own and only used if HWCAP says so
+#define USE_NEON
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define NEON_FN __attribute__ ((target ("fpu=neon")))
+#endif
+
 /*----------------------------------------------------------------------------*/
 /* Macros                                                                     */
 /*----------------------------------------------------------------------------*/
@@ -65,16 +89,48 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define CATALOGUE_URL   "https://magazine.raspberrypi.com/bookshelf.xml"
 #define CONTRIBUTOR_URL "https://magazine.raspberrypi.com/bookshelf/contributor.xml"
 #define CACHE_PATH      "/.cache/bookshelf/"
+#define THUMB_PATH      "/.cache/bookshelf/thumbs/"
+#define COVER_PATH      "/.cache/bookshelf/covers/"
 #define PDF_PATH        "/Bookshelf/"
 #define GUIDE_PATH      "/usr/share/userguide/"
+#define GUIDE_STATE     "/.cache/bookshelf/userguide.state"
+#define RESOURCE_PATH   "/com/raspberrypi/bookshelf/"
 
 #define USER_AGENT      "Raspberry Pi Bookshelf/0.1"
 
 #define MIN_SPACE       10000000.0
 
-#define CURL_TIMEOUT    1000
+#define COVER_BATCH     32
+#define COVER_BUDGET    67108864
+#define COVER_MAX_AGE   604800
+#define USED_INTERVAL   86400
+
+#define SEARCH_DELAY    100
+#define BULK_ROWS       256
+
+#define CONFIG_FILE     "rp-bookshelf.conf"
+#define MAX_TRANSFERS   4
+#define SEGMENTS        4
+#define SEGMENT_MIN     8388608
+
+/* Transfer flags */
+
+#define XFER_MODAL          0x01    /* user is waiting - skip the queue and drive the modal progress bar */
+#define XFER_CONDITIONAL    0x02    /* send stored validators so an unchanged file is not transferred */
+#define XFER_RESUMABLE      0x04    /* keep the partial file and a journal so an interrupted transfer can carry on */
+#define XFER_ITEM           0x08    /* user asked for the item at this URL - queue ahead of covers, show progress on its tile */
+#define XFER_SEGMENTED      0x10    /* if the file is large and the server allows ranges, fetch several parts at once */
 
-/* Columns in item list store */
+#define JOURNAL_STEP        1048576 /* bytes received between updates of a resumable transfer's journal */
+#define HASH_CHUNK          65536   /* bytes read back at a time to bring a checksum up to the end of the data */
+#define COPY_CHUNK          65536   /* bytes copied at a time when the kernel cannot copy a file itself */
+
+/* Tracing */
+
+#define TRACE_ENV           "RP_BOOKSHELF_TRACE"    /* file to write a Chrome trace-event log to on exit */
+#define TRACE_EVENTS        16384                   /* events kept per thread - any more are counted and dropped */
+
+/* Columns of the item models */
 
 #define ITEM_CATEGORY       0
 #define ITEM_TITLE          1
@@ -83,6 +139,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define ITEM_COVPATH        4
 #define ITEM_DOWNLOADED     5
 #define ITEM_COVER          6
+#define ITEM_INDEX          7
+#define ITEM_PROGRESS       8
+#define ITEM_HASH           9
+#define NUM_ITEM_COLS       10
+
+/* Tile states shown in place of a download percentage */
+
+#define PROGRESS_FAILED     -2      /* the last download of the item failed */
+#define PROGRESS_NOSPACE    -3      /* the last download of the item ran out of disk space */
 
 /* Publication category */
 
@@ -90,13 +155,25 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define CAT_BOOKS           1
 #define NUM_CATS            2
 
+/* Catalogue snapshot */
+
+#define SNAP_MAGIC          0x4b534250
+#define SNAP_VERSION        2
+#define SNAP_DIGEST_LEN     32
+
+/* Cover thumbnail cache */
+
+#define THUMB_MAGIC         0x424d4854
+#define THUMB_VERSION       2
+
 /* Termination function arguments */
 
 typedef enum {
     NOSPACE = -2,
     CANCELLED = -1,
     FAILURE = 0,
-    SUCCESS = 1
+    SUCCESS = 1,
+    UNCHANGED = 2
 } tf_status;
 
 typedef enum {
@@ -105,6 +182,214 @@ typedef enum {
     FILE_LOCKED
 } file_status;
 
+/* Where an item's file was found, as recorded in a catalogue's set of files */
+
+#define FOUND_SYSTEM        0x01    /* in the package data dir */
+#define FOUND_LOCAL         0x02    /* in the user's bookshelf */
+
+/* State for a single curl transfer */
+
+typedef struct transfer {
+    CURL *handle;
+    int fd;
+    char *url, *fname, *tmpname, *auth_key;
+    char *etag, *lastmod;
+    struct curl_slist *headers;
+    void (*term_fn) (tf_status success, gpointer data);
+    gpointer data;
+    int flags;
+    tf_status downstat;
+    curl_off_t offset, journalled;
+    char *range;
+    int percent;
+    struct transfer *parent;    /* for a segment, the download it is part of */
+    GList *segments;            /* for a split download, its other segments in file order */
+    curl_off_t pos, end;        /* next byte to write, and where this part stops (0 for the end of the response) */
+    curl_off_t total;           /* length of the whole file, once known */
+    gboolean accept_ranges, done;
+    char *hash;                 /* expected SHA-256 of the whole file, in hex */
+    GChecksum *checksum;        /* running SHA-256 of the file so far */
+    curl_off_t hashed;          /* how much of the file the checksum has seen */
+} transfer_t;
+
+/* Fields within a catalogue item */
+
+typedef enum {
+    FIELD_TITLE,
+    FIELD_DESC,
+    FIELD_COVER,
+    FIELD_PDF,
+    FIELD_FILE,
+    FIELD_HASH,
+    NUM_FIELDS
+} item_field;
+
+/* Unterminated run of text within the catalogue */
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} span_t;
+
+/* Cover thumbnail file layout - header, then the pixbuf's pixel data */
+
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    guint32 width;
+    guint32 height;
+    guint32 rowstride;
+    guint32 has_alpha;
+    guint64 src_size;
+    gint64 src_mtime;
+} thumb_header_t;
+
+/* Box filter taps for one output pixel - first input pixel, and 8-bit weights summing to 256 */
+
+typedef struct {
+    int first;
+    int count;
+    guint16 *weights;
+} box_taps_t;
+
+/* Overlay premultiplied by its alpha, laid out as RGB bytes to blend straight onto a cover */
+
+typedef struct {
+    int width;
+    int height;
+    guint8 *pre;
+    guint8 *inv;
+} blend_layer_t;
+
+/* Cover to be prepared by the thread pool for an item on the shelf */
+
+typedef struct {
+    guint32 index;
+    guint gen;
+    char *lpath;
+    int dl;
+    gboolean new;
+    GdkPixbuf *cover;
+} cover_job_t;
+
+/* Traced event, in Chrome trace-event terms - a complete span, or one end of an asynchronous one */
+
+typedef struct {
+    const char *name;
+    char *detail;               /* shown with the event if not NULL */
+    gconstpointer id;           /* pairs the ends of an asynchronous span */
+    gint64 ts, dur;             /* microseconds */
+    char ph;
+} trace_event_t;
+
+/* Events recorded by one thread - only that thread writes to it, and the count is published after each event */
+
+typedef struct trace_buf {
+    struct trace_buf *next;
+    int tid;
+    gint len;
+    int dropped;
+    trace_event_t events[TRACE_EVENTS];
+} trace_buf_t;
+
+/* Cover cache file considered for eviction */
+
+typedef struct {
+    char *path;
+    goffset size;               /* bytes, including its validators */
+    time_t used;
+} cache_entry_t;
+
+/* Catalogue item record */
+
+typedef struct {
+    int category;
+    int downloaded;
+    char *title, *desc, *pdfpath, *covpath, *hash;
+    guint32 rank;               /* position in its category's title order */
+    int progress;               /* percentage downloaded, -1 if not downloading, or why the last download stopped; only used on the shelf */
+    GdkPixbuf *cover;           /* cover as shown; only used on the shelf */
+} item_t;
+
+/* Search index - folded title and description of each item, and the items containing each three-byte sequence */
+
+typedef struct {
+    GString *text;
+    GArray *offsets;
+    GHashTable *trigrams;
+} search_index_t;
+
+/* Parsed catalogue - strings are held in a string chunk if parsed from XML, or in the mapping if loaded from a snapshot;
+ * files maps the names of the files already on the system to where they were found */
+
+typedef struct {
+    GArray *items;
+    GStringChunk *strings;
+    GMappedFile *map;
+    int counts[NUM_CATS];
+    gboolean locked_items;
+    search_index_t *index;
+    GArray *order[NUM_CATS];
+    GHashTable *files;
+} catalogue_t;
+
+/* Tree model for one tab of the icon views - the indices of the shelf items it shows, in title order */
+
+typedef struct {
+    GObject parent;
+    int category;
+    GArray *rows;
+    catalogue_t *cat;
+    gint stamp;
+} ItemModel;
+
+typedef struct {
+    GObjectClass parent_class;
+} ItemModelClass;
+
+#define ITEM_TYPE_MODEL     (item_model_get_type ())
+#define ITEM_MODEL(obj)     (G_TYPE_CHECK_INSTANCE_CAST ((obj), ITEM_TYPE_MODEL, ItemModel))
+
+/* What to do once a catalogue file has been read */
+
+typedef enum {
+    READ_PRELOAD,       /* startup - show the last catalogue only if its snapshot is up to date */
+    READ_DOWNLOADED,    /* just downloaded - back it up if valid, else fall back */
+    READ_CACHED,        /* unchanged on the server - fall back, and refetch in full next time, if not valid */
+    READ_FALLBACK       /* the backup - nothing else to try */
+} read_mode;
+
+/* Catalogue load request passed to the worker thread */
+
+typedef struct {
+    char *path;
+    read_mode mode;
+    guint gen;
+} read_req_t;
+
+/* Snapshot file layout - header, then item records, then the string table the records index into */
+
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    guint32 count;
+    guint32 locked;
+    guint32 strtab_len;
+    guint32 reserved;
+    guint64 src_size;
+    gint64 src_mtime;
+    gint64 pdf_mtime;
+    gint64 sys_mtime;
+    char lang[16];
+    guint8 digest[SNAP_DIGEST_LEN];
+} snap_header_t;
+
+typedef struct {
+    guint32 category;
+    guint32 downloaded;
+    guint32 title, desc, pdfpath, covpath, hash;
+} snap_item_t;
+
 /* DBus */
 
 #define DBUS_BUS_NAME       "com.raspberrypi.bookshelf"
@@ -120,46 +405,113 @@ typedef enum {
 static GtkWidget *main_dlg, *close_btn, *web_btn, *items_nb, *search_box, *contrib_btn;
 static GtkWidget *item_ivs[NUM_CATS];
 static GtkWidget *msg_dlg, *msg_msg, *msg_pb, *msg_ok, *msg_cancel;
+static int msg_wait;
+
+/* Latest download progress, and the frame callback which will show it */
+
+static double pb_fraction;
+static guint pb_tick;
 
 /* Preloaded default pixbufs */
 
 static GdkPixbuf *cloud, *grey, *nocover, *nodl, *newcorn, *padlock, *nolock;
 
-/* Data store for icon grid */
+/* Overlays prepared for the blend kernels */
+
+static blend_layer_t grey_layer, cloud_layer, padlock_layer, newcorn_layer;
+
+/* Pixel kernels, selected at startup for the instruction set the CPU supports */
+
+static void (*accumulate_row) (guint16 *acc, const guint8 *src, int len, guint16 weight);
+static void (*blend_span) (guint8 *dst, const guint8 *pre, const guint8 *inv, int len);
+
+/* Catalogue shown in the icon grid */
+
+catalogue_t *shelf;
 
-GtkListStore *items;
+/* Models showing each tab's items which pass the search */
 
-/* Filtered versions of the above */
+ItemModel *filtered[NUM_CATS];
 
-GtkTreeModel *filtered[NUM_CATS];
-GtkTreeModel *sorted;
+/* Search index for the items on the shelf, which of them match the search text, and tabs not yet refiltered for it */
+
+search_index_t *search_idx;
+guint8 *search_match;
+gboolean search_all = TRUE;
+gboolean search_stale[NUM_CATS];
+guint search_timer;
 
 /* Download items */
 
-GtkTreeIter selitem, covitem;
+int selitem;
+guint cover_idle;
+
+/* Shelf items by ITEM_INDEX in the order their covers should be loaded, and which have been handed off */
+
+GArray *cover_order;
+guint cover_pos;
+guint8 *cover_queued;
+guint ncovers;
+int cover_unchecked = -1;   /* shown from the cache, but waiting for room in the queue to be checked with the server */
+guint reprio_idle;
+
+/* Incremented each time the shelf is replaced, so covers prepared for an old one can be dropped -
+ * unless the item is still there with the same cover, which cover_remap maps its previous index to */
+
+guint store_gen;
+int *cover_remap;
+guint cover_remap_len;
+
+/* Cover preparation thread pool and its finished jobs */
+
+GThreadPool *cover_pool;
+GAsyncQueue *done_covers;
+gint covers_flush;
 
 /* Catalogue file path */
 
 char *catpath, *cbpath;
 
+/* Watches on the user's bookshelf and the user guide, so files added or removed outside the program are shown */
+
+GFileMonitor *pdf_monitor, *guide_monitor;
+
+/* Incremented for each catalogue load, so a stale worker result can be ignored */
+
+guint read_gen;
+
+/* Startup timing */
+
+gint64 start_time, first_grid;
+
+/* Tracing - on if a file was given to write to; every thread which records gets a buffer on the list */
+
+gboolean tracing;
+char *trace_file;
+trace_buf_t *trace_bufs;
+gint trace_tids;
+GPrivate trace_key = G_PRIVATE_INIT (NULL);
+
 /* Saved copy of argv[1] */
 
 char *url_arg;
 
 /* Libcurl variables */
 
-CURL *http_handle;
 CURLM *multi_handle;
-FILE *outfile;
+CURLSH *share_handle;
+GSList *idle_handles;
 guint curl_timer;
-void (*term_fn) (tf_status success);
-char *fname, *tmpname;
+GQueue pending_xfers = G_QUEUE_INIT;
+GList *active_xfers;
+int max_transfers, max_segments;
+gint64 cover_budget;
 gboolean cancelled;
-tf_status downstat;
 
-/* Flags to manage simultaneous download of art and PDF */
+/* Connection statistics */
+
+long conns_opened, conns_reused;
 
-gboolean cover_dl, pdf_dl_req;
 gulong draw_id;
 
 /* DBus */
@@ -181,11 +533,22 @@ static const gchar introspection_xml[] =
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
+static char *url_basename (const char *url);
+static void init_trace (void);
+static trace_buf_t *trace_buffer (void);
+static void trace_record (char ph, const char *name, gconstpointer id, gint64 ts, gint64 dur, const char *detail);
+static gint64 trace_now (void);
+static void trace_span (const char *name, gint64 start);
+static void trace_begin (const char *name, gconstpointer id, const char *detail);
+static void trace_end (const char *name, gconstpointer id);
+static void write_json_string (FILE *fp, const char *str);
+static void write_trace (void);
 static char *get_local_path (char *path, const char *dir);
+static int find_item (const char *pdfpath);
 static void create_dir (char *dir);
-static unsigned long int get_val (char *cmd);
-static char *get_string (char *cmd);
-static curl_off_t free_space (void);
+static gboolean copy_file (const char *src, const char *dst);
+static curl_off_t free_space (const char *path);
+static curl_off_t file_size (const char *path);
 static gboolean save_access_key (char *url);
 static void entitle (char *buffer);
 static void init_dbus (void);
@@ -194,27 +557,169 @@ static void name_acquired (GDBusConnection *connection, const gchar *name, gpoin
 static void name_lost (GDBusConnection *connection, const gchar *name, gpointer);
 static void handle_method_call (GDBusConnection *, const gchar*, const gchar*, const gchar*,
     const gchar *method_name, GVariant *parameters, GDBusMethodInvocation *invocation, gpointer);
-static void start_curl_download (char *url, char *file, void (*end_fn)(tf_status success), char *auth_key);
-static gboolean curl_poll (gpointer data);
-static void finish_curl_download (void);
-static int progress_func (GtkWidget *bar, curl_off_t t, curl_off_t d, curl_off_t ultotal, curl_off_t ulnow);
+static void load_config (void);
+static void init_curl (void);
+static void close_curl (void);
+static void start_curl_download (char *url, char *file, void (*end_fn)(tf_status success, gpointer data), gpointer data, char *auth_key, char *hash, int flags);
+static gboolean transfer_pending (const char *file);
+static transfer_t *item_transfer (const char *url);
+static guint queued_background (void);
+static int transfer_connections (void);
+static void cancel_transfer (transfer_t *xfer);
+static void free_transfer (transfer_t *xfer);
+static void dispatch_transfers (void);
+static void begin_transfer (transfer_t *xfer);
+static void setup_handle (transfer_t *xfer);
+static void release_handle (transfer_t *xfer);
+static void split_transfer (transfer_t *xfer, int parts);
+static void start_segments (void);
+static curl_off_t contiguous_bytes (transfer_t *xfer);
+static gboolean transfer_complete (transfer_t *xfer);
+static int curl_socket_cb (CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+static int curl_timer_cb (CURLM *multi, long timeout_ms, void *userp);
+static gboolean curl_socket_event (gint fd, GIOCondition cond, gpointer data);
+static gboolean curl_timeout (gpointer data);
+static void check_transfers (CURLMcode res);
+static void finish_curl_download (transfer_t *xfer);
+static char *validator_key (transfer_t *xfer);
+static void load_validators (transfer_t *xfer);
+static void save_validators (transfer_t *xfer);
+static void discard_validators (char *file);
+static void touch_validators (char *file);
+static curl_off_t load_journal (transfer_t *xfer);
+static gboolean save_journal (transfer_t *xfer, curl_off_t bytes);
+static void discard_journal (transfer_t *xfer);
+static size_t write_func (char *ptr, size_t size, size_t nmemb, transfer_t *xfer);
+static void transfer_written (transfer_t *xfer);
+static gboolean advance_hash (transfer_t *xfer);
+static gboolean check_hash (transfer_t *xfer);
+static size_t header_func (char *buffer, size_t size, size_t nitems, transfer_t *xfer);
+static gboolean reserve_space (transfer_t *xfer);
+static int progress_func (transfer_t *xfer, curl_off_t t, curl_off_t d, curl_off_t ultotal, curl_off_t ulnow);
+static void set_progress (double fraction);
+static void set_item_progress (transfer_t *xfer, int percent);
+static gboolean update_progress (GtkWidget *widget, GdkFrameClock *clock, gpointer data);
+static void progress_done (gpointer data);
+static void accumulate_row_c (guint16 *acc, const guint8 *src, int len, guint16 weight);
+static void blend_span_c (guint8 *dst, const guint8 *pre, const guint8 *inv, int len);
+#ifdef USE_SSE2
+static void accumulate_row_sse2 (guint16 *acc, const guint8 *src, int len, guint16 weight);
+static void blend_span_sse2 (guint8 *dst, const guint8 *pre, const guint8 *inv, int len);
+#endif
+#ifdef USE_NEON
+static void accumulate_row_neon (guint16 *acc, const guint8 *src, int len, guint16 weight);
+static void blend_span_neon (guint8 *dst, const guint8 *pre, const guint8 *inv, int len);
+static gboolean cpu_has_neon (void);
+#endif
+static void init_kernels (void);
+static box_taps_t *box_taps (int src, int dst);
+static void free_taps (box_taps_t *taps, int n);
+static GdkPixbuf *scale_cover (GdkPixbuf *pb, int dw, int dh);
+static void make_layer (blend_layer_t *layer, GdkPixbuf *pb, int alpha);
+static gboolean blend_layer (GdkPixbuf *cover, const blend_layer_t *layer, int x, int y);
+static gboolean overlay_cover (GdkPixbuf *cover, const blend_layer_t *icon);
+static char *cover_path (const char *url);
+static gboolean cover_stale (const char *lpath);
+static void mark_used (const char *path);
+static void add_cache_entries (GArray *entries, const char *dir, gint64 *total);
+static gint compare_used (gconstpointer a, gconstpointer b);
+static void trim_cache_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancellable);
+static void trim_cache (void);
+static void load_overlays (void);
 static GdkPixbuf *get_cover (const char *filename);
-static void update_cover_entry (char *lpath, int dl, gboolean new);
+static char *thumb_path (const char *lpath, int dl, gboolean new);
+static GdkPixbuf *load_thumb (const char *tpath, gint64 mtime, goffset size);
+static void save_thumb (const char *tpath, GdkPixbuf *pb, gint64 mtime, goffset size);
+static GdkPixbuf *make_cover (char *lpath, int dl, gboolean new);
+static void update_cover_entry (int index, char *lpath, int dl, gboolean new);
+static void cover_worker (gpointer data, gpointer user_data);
+static gboolean flush_covers (gpointer data);
 static gboolean find_cover_for_item (gpointer data);
-static void image_download_done (tf_status success);
+static void add_cover_row (ItemModel *model, int pos);
+static void prioritise_covers (void);
+static gboolean reprioritise (gpointer data);
+static void schedule_reprioritise (void);
+static void resume_covers (void);
+static void set_downloaded_cover (const char *url, gboolean new);
+static void image_download_done (tf_status success, gpointer data);
+static void cover_refreshed (tf_status success, gpointer data);
 static void pdf_selected (void);
 static void open_pdf (char *path);
-static void pdf_download_done (tf_status success);
-static void get_pending_pdf (void);
-static void remap_title (char **title);
+static void pdf_download_done (tf_status success, gpointer data);
+static gboolean remap_title (const char *title, size_t len, const char **remapped);
 static void download_catalogue (void);
-static void load_catalogue (tf_status success);
-static void load_contrib_catalogue (tf_status success);
-static void get_param (char *linebuf, char *name, char *lang, char **dest);
-static int read_data_file (char *path);
-static gboolean match_category (GtkTreeModel *model, GtkTreeIter *iter, gpointer data);
-static void search_update (GtkSearchEntry *self, gpointer data);
+static void load_catalogue (tf_status success, gpointer data);
+static void load_contrib_catalogue (tf_status success, gpointer data);
+static gboolean partial_file (const char *name);
+static void scan_dir (GHashTable *files, const char *dir, guint where);
+static GHashTable *scan_files (void);
+static guint file_found (GHashTable *files, const char *url);
+static gboolean url_has_name (const char *url, const char *name);
+static void file_changed (const char *name, guint where, gboolean found);
+static int item_status (GHashTable *files, char *pdfpath, gboolean locked);
+static const char *get_lang (void);
+static void add_item (catalogue_t *cat, int category, char *title, char *desc, char *pdfpath, char *covpath, char *hash, int downloaded);
+static catalogue_t *new_catalogue (void);
+static void free_catalogue (catalogue_t *cat);
+static gboolean tag_is (const char *tag, size_t len, const char *name);
+static char *field_text (catalogue_t *cat, span_t *field);
+static void emit_item (catalogue_t *cat, int category, span_t fields[NUM_FIELDS][2]);
+static catalogue_t *parse_catalogue (char *path, GHashTable *files);
+static gboolean file_digest (char *path, guint8 *digest);
+static gint64 file_mtime (const char *path, goffset *size);
+static void write_snapshot (char *path, catalogue_t *cat);
+static catalogue_t *load_snapshot (char *path, GHashTable *files);
+static gint compare_items (gconstpointer a, gconstpointer b, gpointer data);
+static void sort_catalogue (catalogue_t *cat);
+static void attach_shelf (catalogue_t *cat);
+static char *item_key (item_t *item);
+static GdkPixbuf *default_cover (int dl);
+static void update_tab (int category, catalogue_t *old, const int *moved);
+static int fill_store (catalogue_t *cat);
+static void backup_catalogue (void);
+static catalogue_t *read_catalogue (char *path, read_mode mode, GHashTable *files);
+static void read_data_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancellable);
+static void data_file_read (GObject *source, GAsyncResult *res, gpointer data);
+static void free_read_req (read_req_t *req);
+static void read_data_file (char *path, read_mode mode);
+static void fold_text (GString *out, const char *str);
+static guint32 trigram (const char *str);
+static search_index_t *build_search_index (catalogue_t *cat);
+static void free_search_index (search_index_t *idx);
+GType item_model_get_type (void);
+static void item_model_tree_model_init (GtkTreeModelIface *iface);
+static void item_model_finalize (GObject *obj);
+static GtkTreeModelFlags item_model_get_flags (GtkTreeModel *model);
+static gint item_model_get_n_columns (GtkTreeModel *model);
+static GType item_model_get_column_type (GtkTreeModel *model, gint column);
+static void item_model_set_iter (ItemModel *model, GtkTreeIter *iter, guint pos);
+static gboolean item_model_get_iter (GtkTreeModel *model, GtkTreeIter *iter, GtkTreePath *path);
+static GtkTreePath *item_model_get_path (GtkTreeModel *model, GtkTreeIter *iter);
+static void item_model_get_value (GtkTreeModel *model, GtkTreeIter *iter, gint column, GValue *value);
+static gboolean item_model_iter_next (GtkTreeModel *model, GtkTreeIter *iter);
+static gboolean item_model_iter_previous (GtkTreeModel *model, GtkTreeIter *iter);
+static gboolean item_model_iter_children (GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *parent);
+static gboolean item_model_iter_has_child (GtkTreeModel *model, GtkTreeIter *iter);
+static gint item_model_iter_n_children (GtkTreeModel *model, GtkTreeIter *iter);
+static gboolean item_model_iter_nth_child (GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *parent, gint n);
+static gboolean item_model_iter_parent (GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *child);
+static ItemModel *item_model_new (catalogue_t *cat, int category, GArray *rows);
+static int item_model_find (ItemModel *model, guint32 index);
+static guint merge_rows (ItemModel *model, GArray *rows, gboolean apply);
+static void item_changed (int index);
+static void run_search (void);
+static GArray *filter_rows (catalogue_t *cat, int category);
+static void set_rows (int category, GArray *rows);
+static void refilter_tab (int category);
+static gboolean search_timeout (gpointer data);
+static void search_changed (GtkEditable *self, gpointer data);
+static void search_update (void);
+static void page_switched (GtkNotebook *nb, GtkWidget *page, guint num, gpointer data);
 static void symlink_user_guide (void);
+static void sync_guide_file (const char *name);
+static void bookshelf_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, gpointer data);
+static void guide_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, gpointer data);
+static void watch_dirs (void);
 static gboolean ok_clicked (GtkButton *button, gpointer data);
 static gboolean cancel_clicked (GtkButton *button, gpointer data);
 static gboolean download_fallback (GtkButton *button, gpointer data);
@@ -223,40 +728,203 @@ static void hide_message (void);
 static void item_selected (GtkIconView *iconview, GtkTreePath *path, gpointer user_data);
 static void handle_menu_open (GtkWidget *widget, gpointer user_data);
 static void handle_menu_delete_file (GtkWidget *widget, gpointer user_data);
+static void handle_menu_cancel (GtkWidget *widget, gpointer user_data);
+static void show_progress (GtkCellLayout *layout, GtkCellRenderer *renderer, GtkTreeModel *model, GtkTreeIter *iter, gpointer data);
 static void create_cs_menu (GdkEvent *event);
 static gboolean icon_clicked (GtkWidget *wid, GdkEventButton *event, gpointer user_data);
 static void refresh_icons (void);
-static gint pub_sort (GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b, gpointer user_data);
 static void web_link (GtkButton* btn, gpointer ptr);
 static void contribute (GtkButton* btn, gpointer ptr);
 static void close_prog (GtkButton* btn, gpointer ptr);
 static gboolean first_draw (GtkWidget *instance);
 
+/*----------------------------------------------------------------------------*/
+/* Tracing                                                                    */
+/*----------------------------------------------------------------------------*/
+
+/* init_trace - turn tracing on if a file was given for it, and give the main thread the first buffer */
+
+static void init_trace (void)
+{
+    const char *path = g_getenv (TRACE_ENV);
+
+    if (!path || !*path) return;
+    trace_file = g_strdup (path);
+    tracing = TRUE;
+    trace_buffer ();
+}
+
+/* trace_buffer - the calling thread's event buffer, created and added to the list on first use */
+
+static trace_buf_t *trace_buffer (void)
+{
+    trace_buf_t *buf = g_private_get (&trace_key);
+
+    if (buf) return buf;
+    buf = g_new0 (trace_buf_t, 1);
+    buf->tid = g_atomic_int_add (&trace_tids, 1) + 1;
+
+    // the list is only ever pushed onto, so each new buffer just has to win the swap for its head
+    do buf->next = g_atomic_pointer_get (&trace_bufs);
+    while (!g_atomic_pointer_compare_and_exchange (&trace_bufs, buf->next, buf));
+
+    g_private_set (&trace_key, buf);
+    return buf;
+}
+
+/* trace_record - add an event to the calling thread's buffer */
+
+static void trace_record (char ph, const char *name, gconstpointer id, gint64 ts, gint64 dur, const char *detail)
+{
+    trace_buf_t *buf = trace_buffer ();
+    trace_event_t *ev;
+
+    if (buf->len == TRACE_EVENTS)
+    {
+        buf->dropped++;
+        return;
+    }
+
+    ev = &buf->events[buf->len];
+    ev->ph = ph;
+    ev->name = name;
+    ev->id = id;
+    ev->ts = ts;
+    ev->dur = dur;
+    ev->detail = g_strdup (detail);
+    g_atomic_int_set (&buf->len, buf->len + 1);
+}
+
+/* trace_now - start time for a span, or 0 if tracing is off */
+
+static gint64 trace_now (void)
+{
+    return tracing ? g_get_monotonic_time () : 0;
+}
+
+/* trace_span - record a span on the calling thread from a time given by trace_now until now */
+
+static void trace_span (const char *name, gint64 start)
+{
+    if (start) trace_record ('X', name, NULL, start, g_get_monotonic_time () - start, NULL);
+}
+
+/* trace_begin - record the start of a span which may end on a later callback, identified by id */
+
+static void trace_begin (const char *name, gconstpointer id, const char *detail)
+{
+    if (tracing) trace_record ('b', name, id, g_get_monotonic_time (), 0, detail);
+}
+
+/* trace_end - record the end of a span started by trace_begin */
+
+static void trace_end (const char *name, gconstpointer id)
+{
+    if (tracing) trace_record ('e', name, id, g_get_monotonic_time (), 0, NULL);
+}
+
+/* write_json_string - write a string to a JSON file, quoted and escaped */
+
+static void write_json_string (FILE *fp, const char *str)
+{
+    fputc ('"', fp);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\') fprintf (fp, "\\%c", *str);
+        else if ((guchar) *str < 0x20) fprintf (fp, "\\u%04x", *str);
+        else fputc (*str, fp);
+    }
+    fputc ('"', fp);
+}
+
+/* write_trace - save everything recorded as a Chrome trace-event file, which Perfetto and chrome://tracing can load */
+
+static void write_trace (void)
+{
+    trace_buf_t *buf;
+    trace_event_t *ev;
+    FILE *fp;
+    int i, n, pid = getpid ();
+
+    if (!tracing) return;
+    if (!(fp = fopen (trace_file, "w")))
+    {
+        g_debug ("Unable to write trace to %s", trace_file);
+        return;
+    }
+
+    // times are from the start of main; other threads are still running, so only what each has published is written
+    fprintf (fp, "{\"traceEvents\":[\n");
+    for (buf = g_atomic_pointer_get (&trace_bufs); buf; buf = buf->next)
+    {
+        fprintf (fp, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, buf->tid, buf->tid == 1 ? "main" : "worker");
+        n = g_atomic_int_get (&buf->len);
+        for (i = 0; i < n; i++)
+        {
+            ev = &buf->events[i];
+            fprintf (fp, ",\n{\"ph\":\"%c\",\"cat\":\"bookshelf\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT,
+                ev->ph, ev->name, pid, buf->tid, ev->ts - start_time);
+            if (ev->ph == 'X') fprintf (fp, ",\"dur\":%" G_GINT64_FORMAT, ev->dur);
+            else fprintf (fp, ",\"id\":\"%p\"", ev->id);
+            if (ev->detail)
+            {
+                fprintf (fp, ",\"args\":{\"detail\":");
+                write_json_string (fp, ev->detail);
+                fputc ('}', fp);
+            }
+            fputc ('}', fp);
+        }
+        fprintf (fp, "%s\n", buf->next ? "," : "");
+        if (buf->dropped) g_debug ("%d trace events dropped on thread %d", buf->dropped, buf->tid);
+    }
+    fprintf (fp, "],\"displayTimeUnit\":\"ms\"}\n");
+    fclose (fp);
+}
+
 /*----------------------------------------------------------------------------*/
 /* Helpers                                                                    */
 /*----------------------------------------------------------------------------*/
 
+/* url_basename - creates a string with the name a URL's file is stored under */
+
+static char *url_basename (const char *url)
+{
+    gchar *basename, *query;
+    basename = g_path_get_basename (url);
+    query = strchr (basename, '?');
+    if (query) *query = 0;
+    return basename;
+}
+
 /* get_local_path - creates a string with path to file in user's home dir */
 
 static char *get_local_path (char *path, const char *dir)
 {
     gchar *basename, *rpath;
-    basename = g_path_get_basename (path);
-    rpath = strchr (basename, '?');
-    if (rpath) *rpath = 0;
+    basename = url_basename (path);
     rpath = g_strdup_printf ("%s%s%s", g_get_home_dir (), dir, basename);
     g_free (basename);
     return rpath;
 }
 
+/* find_item - find the first item on the shelf with the given PDF URL, or -1 if there is none */
+
+static int find_item (const char *pdfpath)
+{
+    int i;
+
+    for (i = 0; shelf && i < shelf->items->len; i++)
+        if (!g_strcmp0 (g_array_index (shelf->items, item_t, i).pdfpath, pdfpath)) return i;
+    return -1;
+}
+
 /* get_system_path - creates a string with path to file in package data dir */
 
 static char *get_system_path (char *path)
 {
     gchar *basename, *rpath;
-    basename = g_path_get_basename (path);
-    rpath = strchr (basename, '?');
-    if (rpath) *rpath = 0;
+    basename = url_basename (path);
     rpath = g_strdup_printf ("%s/%s", PACKAGE_DATA_DIR, basename);
     g_free (basename);
     return rpath;
@@ -276,65 +944,62 @@ static void create_dir (char *dir)
     g_free (path);
 }
 
-/* get_val - call a system command and convert the first string returned to a number */
+/* copy_file - copy a file without passing it through user space where possible, replacing the destination atomically */
 
-static unsigned long int get_val (char *cmd)
+static gboolean copy_file (const char *src, const char *dst)
 {
-    FILE *fp;
-    char buf[64];
-    unsigned long res;
-
-    fp = popen (cmd, "r");
-    if (fp == NULL) return 0;
-    if (fgets (buf, sizeof (buf) - 1, fp) == NULL)
-    {
-        pclose (fp);
-        return 0;
-    }
-    else
+    struct stat st;
+    char *tmppath, *buf;
+    off_t left = 1;
+    ssize_t n;
+    int in, out;
+    gboolean ok;
+
+    if ((in = open (src, O_RDONLY)) == -1) return FALSE;
+    tmppath = g_strdup_printf ("%s.tmp", dst);
+    out = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out != -1 && fstat (in, &st) != -1)
     {
-        pclose (fp);
-        if (sscanf (buf, "%ld", &res) != 1) return 0;
-        return res;
+        // the kernel shares the blocks on filesystems which can, and copies them in place on those which cannot
+        left = st.st_size;
+        while (left > 0 && (n = copy_file_range (in, NULL, out, NULL, left, 0)) > 0) left -= n;
+
+        // older kernels cannot at all, so carry on through a buffer from wherever that got to
+        if (left > 0)
+        {
+            buf = g_malloc (COPY_CHUNK);
+            while (left > 0 && (n = read (in, buf, COPY_CHUNK)) > 0 && write (out, buf, n) == n) left -= n;
+            g_free (buf);
+        }
     }
+    close (in);
+
+    ok = out != -1 && left == 0;
+    if (out != -1 && close (out) != 0) ok = FALSE;
+    if (ok && rename (tmppath, dst) == -1) ok = FALSE;
+    if (!ok) remove (tmppath);
+    g_free (tmppath);
+    return ok;
 }
 
-/* get_string - call a system command and return the first string in the output */
+/* free_space - find space available to the user on the filesystem holding path */
 
-static char *get_string (char *cmd)
+static curl_off_t free_space (const char *path)
 {
-    char *line = NULL, *res = NULL;
-    size_t len = 0;
-    FILE *fp = popen (cmd, "r");
+    struct statvfs buf;
 
-    if (fp == NULL) return NULL;
-    if (getline (&line, &len, fp) > 0)
-    {
-        res = line;
-        while (*res)
-        {
-            if (g_ascii_isspace (*res)) *res = 0;
-            res++;
-        }
-        res = g_strdup (line);
-    }
-    pclose (fp);
-    g_free (line);
-    return res;
+    if (statvfs (path, &buf) == -1) return -1;
+    return (curl_off_t) buf.f_bavail * buf.f_frsize;
 }
 
-/* free_space - find free space on filesystem */
+/* file_size - size of the file at path, or 0 if there is none */
 
-static curl_off_t free_space (void)
+static curl_off_t file_size (const char *path)
 {
-    char *cmd;
-    unsigned long fs;
-    curl_off_t ffs = 1024;
-    cmd = g_strdup_printf ("df --output=avail %s%s | tail -n 1", g_get_home_dir (), PDF_PATH);
-    fs = get_val (cmd);
-    g_free (cmd);
-    ffs *= fs;
-    return ffs;
+    struct stat buf;
+
+    if (stat (path, &buf) == -1) return 0;
+    return buf.st_size;
 }
 
 /* save_access_key - check for a valid access key and write it to the cache file */
@@ -375,6 +1040,41 @@ static void entitle (char *buffer)
     }
 }
 
+/* load_config - read user or system settings file, falling back to defaults */
+
+static void load_config (void)
+{
+    GKeyFile *kf;
+    const gchar * const *sys_dirs;
+    const gchar **dirs;
+    gint64 size;
+    int i, n;
+
+    max_transfers = MAX_TRANSFERS;
+    max_segments = SEGMENTS;
+    cover_budget = COVER_BUDGET;
+
+    // user config dir takes precedence over the system ones
+    sys_dirs = g_get_system_config_dirs ();
+    for (n = 0; sys_dirs[n]; n++);
+    dirs = g_new0 (const gchar *, n + 2);
+    dirs[0] = g_get_user_config_dir ();
+    for (i = 0; i < n; i++) dirs[i + 1] = sys_dirs[i];
+
+    kf = g_key_file_new ();
+    if (g_key_file_load_from_dirs (kf, CONFIG_FILE, dirs, NULL, G_KEY_FILE_NONE, NULL))
+    {
+        i = g_key_file_get_integer (kf, "Downloads", "MaxTransfers", NULL);
+        if (i > 0) max_transfers = i;
+        i = g_key_file_get_integer (kf, "Downloads", "Segments", NULL);
+        if (i > 0) max_segments = i;
+        size = g_key_file_get_int64 (kf, "Cache", "CoverCacheBytes", NULL);
+        if (size > 0) cover_budget = size;
+    }
+    g_key_file_free (kf);
+    g_free (dirs);
+}
+
 /*----------------------------------------------------------------------------*/
 /* DBus interface                                                             */
 /*----------------------------------------------------------------------------*/
@@ -437,697 +1137,3608 @@ static void handle_method_call (GDBusConnection *, const gchar*, const gchar*, c
 /* libcurl interface                                                          */
 /*----------------------------------------------------------------------------*/
 
-static void start_curl_download (char *url, char *file, void (*end_fn)(tf_status success), char *auth_key)
+/* init_curl - create the process-wide multi and share handles, so connections, DNS lookups and TLS sessions are reused */
+
+static void init_curl (void)
 {
-    int still_running;
-    cancelled = FALSE;
-    downstat = FAILURE;
-    term_fn = end_fn;
-    http_handle = curl_easy_init ();
+    curl_global_init (CURL_GLOBAL_ALL);
+
+    share_handle = curl_share_init ();
+    curl_share_setopt (share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
     multi_handle = curl_multi_init ();
+    curl_multi_setopt (multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 
-    fname = g_strdup (file);
-    tmpname = g_strdup_printf ("%s.curl", file);
-    outfile = fopen (tmpname, "wb");
-    if (!outfile)
-    {
-        g_free (fname);
-        g_free (tmpname);
-        term_fn (FAILURE);
-    }
+    // let curl tell the main loop which sockets and timeouts to wait on
+    curl_multi_setopt (multi_handle, CURLMOPT_SOCKETFUNCTION, curl_socket_cb);
+    curl_multi_setopt (multi_handle, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+}
+
+/* close_curl - release all curl resources at exit */
+
+static void close_curl (void)
+{
+    transfer_t *xfer;
+    GList *al;
+    GSList *l;
 
-    curl_easy_setopt (http_handle, CURLOPT_URL, url);
-    curl_easy_setopt (http_handle, CURLOPT_USERAGENT, USER_AGENT);
-    curl_easy_setopt (http_handle, CURLOPT_WRITEDATA, outfile);
-    curl_easy_setopt (http_handle, CURLOPT_NOPROGRESS, 0L);
-    curl_easy_setopt (http_handle, CURLOPT_XFERINFOFUNCTION, progress_func);
-    curl_easy_setopt (http_handle, CURLOPT_FAILONERROR, 1L);
-    if (auth_key)
+    // the UI has gone, so drop any transfers still in progress without calling back; resumable ones can carry on next time
+    while ((al = active_xfers))
     {
-        curl_easy_setopt (http_handle, CURLOPT_HTTPAUTH, CURLAUTH_BEARER);
-        curl_easy_setopt (http_handle, CURLOPT_XOAUTH2_BEARER, auth_key);
+        xfer = al->data;
+        xfer->term_fn = NULL;
+        finish_curl_download (xfer);
     }
+    for (l = idle_handles; l; l = l->next) curl_easy_cleanup (l->data);
+    g_slist_free (idle_handles);
+    curl_multi_cleanup (multi_handle);
+    curl_share_cleanup (share_handle);
+    curl_global_cleanup ();
 
-    curl_multi_add_handle (multi_handle, http_handle);
-    if (curl_multi_perform (multi_handle, &still_running) == CURLM_OK && still_running)
-        curl_timer = g_idle_add (curl_poll, NULL);
-    else finish_curl_download ();
+    g_debug ("connections opened %ld, reused %ld", conns_opened, conns_reused);
 }
 
-static gboolean curl_poll (gpointer data)
+/* start_curl_download - queue a download of url to file; end_fn is called with data when it completes */
+
+static void start_curl_download (char *url, char *file, void (*end_fn)(tf_status success, gpointer data), gpointer data, char *auth_key, char *hash, int flags)
 {
-    int still_running, numfds;
-    if (curl_multi_wait (multi_handle, NULL, 0, CURL_TIMEOUT, &numfds) != CURLM_OK)
-    {
-        downstat = FAILURE;
-        finish_curl_download ();
-        return FALSE;
-    }
-    if (curl_multi_perform (multi_handle, &still_running) != CURLM_OK)
+    transfer_t *xfer;
+    GList *l;
+
+    xfer = g_new0 (transfer_t, 1);
+    xfer->url = g_strdup (url);
+    xfer->fname = g_strdup (file);
+    xfer->tmpname = g_strdup_printf ("%s.curl", file);
+    xfer->auth_key = g_strdup (auth_key);
+    xfer->hash = g_strdup (hash);
+    xfer->term_fn = end_fn;
+    xfer->data = data;
+    xfer->flags = flags;
+    xfer->downstat = FAILURE;
+    xfer->fd = -1;
+    trace_begin ("download", xfer, url);
+
+    // modal transfers have the user waiting on them, so they bypass the queue
+    if (flags & XFER_MODAL)
     {
-        downstat = FAILURE;
-        finish_curl_download ();
-        return FALSE;
+        cancelled = FALSE;
+        begin_transfer (xfer);
     }
-    if (still_running) return TRUE;
     else
     {
-        if (downstat == FAILURE) downstat = SUCCESS;
-        finish_curl_download ();
-        return FALSE;
+        // items the user asked for go ahead of background transfers, but stay in the order they were asked for
+        l = NULL;
+        if (flags & XFER_ITEM)
+            for (l = pending_xfers.head; l && (((transfer_t *) l->data)->flags & XFER_ITEM); l = l->next);
+        if (l) g_queue_insert_before (&pending_xfers, l, xfer);
+        else g_queue_push_tail (&pending_xfers, xfer);
+        dispatch_transfers ();
     }
 }
 
-static void finish_curl_download (void)
-{
-    CURLMsg *msg;
-    int nmsgs;
-
-    msg = curl_multi_info_read (multi_handle, &nmsgs);
-    if (msg && msg->msg == CURLMSG_DONE)
-    {
-        if (msg->data.result != CURLE_OK)
-        {
-            printf ("curl error %d\n", msg->data.result);
-            if (downstat == SUCCESS) downstat = FAILURE;
-        }
-    }
-
-    if (outfile) fclose (outfile);
-    if (downstat == SUCCESS) rename (tmpname, fname);
-    else remove (tmpname);
-
-    curl_multi_remove_handle (multi_handle, http_handle);
-    curl_easy_cleanup (http_handle);
-    curl_multi_cleanup (multi_handle);
-    curl_global_cleanup ();
+/* transfer_pending - check whether a download to file is already queued or in progress */
 
-    g_free (fname);
-    g_free (tmpname);
+static gboolean transfer_pending (const char *file)
+{
+    GList *l;
 
-    term_fn (downstat);
+    for (l = active_xfers; l; l = l->next)
+        if (!g_strcmp0 (((transfer_t *) l->data)->fname, file)) return TRUE;
+    for (l = pending_xfers.head; l; l = l->next)
+        if (!g_strcmp0 (((transfer_t *) l->data)->fname, file)) return TRUE;
+    return FALSE;
 }
 
-static int progress_func (GtkWidget *bar, curl_off_t t, curl_off_t d, curl_off_t ultotal, curl_off_t ulnow)
+/* item_transfer - find the queued or running download of the item at url */
+
+static transfer_t *item_transfer (const char *url)
 {
-    double prog = d;
-    prog /= t;
+    transfer_t *xfer;
+    GList *l;
 
-    if (cancelled)
+    for (l = active_xfers; l; l = l->next)
     {
-        downstat = CANCELLED;
-        return 1;
+        xfer = l->data;
+        if ((xfer->flags & XFER_ITEM) && !g_strcmp0 (xfer->url, url)) return xfer;
     }
-    if (prog >= 0.0 && prog <= 1.0)
+    for (l = pending_xfers.head; l; l = l->next)
     {
-        if (t + MIN_SPACE >= free_space ())
-        {
-            downstat = NOSPACE;
-            return 1;
-        }
-
-        if (msg_pb)
-        {
-            if (pdf_dl_req) gtk_progress_bar_pulse (GTK_PROGRESS_BAR (msg_pb));
-            else gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (msg_pb), prog);
-        }
+        xfer = l->data;
+        if ((xfer->flags & XFER_ITEM) && !g_strcmp0 (xfer->url, url)) return xfer;
     }
-    return 0;
+    return NULL;
 }
 
+/* queued_background - how many transfers are waiting behind the items the user asked for */
 
-/*----------------------------------------------------------------------------*/
-/* Cover art handling                                                         */
-/*----------------------------------------------------------------------------*/
-
-/* get_cover - reads in cover from filename to pixbuf and scales */
-
-static GdkPixbuf *get_cover (const char *filename)
+static guint queued_background (void)
 {
-    GdkPixbuf *pb, *spb;
-    int w, h;
-    
-    pb = gdk_pixbuf_new_from_file (filename, NULL);
-    if (!pb) pb = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/nocover.png", NULL);
-
-    h = gdk_pixbuf_get_height (pb);
-    if (h == COVER_SIZE) return pb;
-    w = gdk_pixbuf_get_width (pb);
+    guint n = g_queue_get_length (&pending_xfers);
+    GList *l;
 
-    spb = gdk_pixbuf_scale_simple (pb, ((w > h) ? COVER_SIZE : COVER_SIZE * w / h), 
-        ((w > h) ? COVER_SIZE * h / w : COVER_SIZE), GDK_INTERP_BILINEAR);
-    g_object_unref (pb);
-    return spb;
+    for (l = pending_xfers.head; l && (((transfer_t *) l->data)->flags & XFER_ITEM); l = l->next) n--;
+    return n;
 }
 
-/* update_cover_entry - uses the cover at lpath to update the cover info for covitem */
+/* cancel_transfer - stop a queued or running transfer; a resumable one keeps what it has received */
 
-static void update_cover_entry (char *lpath, int dl, gboolean new)
+static void cancel_transfer (transfer_t *xfer)
 {
-    GdkPixbuf *cover;
-    int w, h;
-
-    cover = get_cover (lpath);
-    w = gdk_pixbuf_get_width (cover);
-    h = gdk_pixbuf_get_height (cover);
-
-    switch (dl)
+    xfer->downstat = CANCELLED;
+    if (g_list_find (active_xfers, xfer))
     {
-        case FILE_AVAILABLE:
-            gdk_pixbuf_composite (grey, cover, 0, 0, w, h, 0, 0, 1, 1, GDK_INTERP_BILINEAR, 128);
-            gdk_pixbuf_composite (cloud, cover, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
-            break;
+        finish_curl_download (xfer);
+        dispatch_transfers ();
+    }
+    else
+    {
+        // never started, so there are no files of its own to tidy up
+        g_queue_remove (&pending_xfers, xfer);
+        trace_end ("download", xfer);
+        if (xfer->term_fn) xfer->term_fn (xfer->downstat, xfer->data);
+        free_transfer (xfer);
+    }
+}
 
-        case FILE_LOCKED:
-            gdk_pixbuf_composite (grey, cover, 0, 0, w, h, 0, 0, 1, 1, GDK_INTERP_BILINEAR, 128);
-            gdk_pixbuf_composite (padlock, cover, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
-            break;
+/* transfer_connections - how many requests the running downloads have open, counting each unfinished segment */
 
-        default : break;
-    }
-    if (new) gdk_pixbuf_composite (newcorn, cover, w - 32, 0, 32, 32, w - 32, 0, 1, 1, GDK_INTERP_BILINEAR, 255);
+static int transfer_connections (void)
+{
+    transfer_t *xfer;
+    GList *l, *sl;
+    int n = 0;
 
-    gtk_list_store_set (items, &covitem, ITEM_COVER, cover, -1);
-    g_object_unref (cover);
+    for (l = active_xfers; l; l = l->next)
+    {
+        xfer = l->data;
+        n++;
+        for (sl = xfer->segments; sl; sl = sl->next)
+            if (!((transfer_t *) sl->data)->done) n++;
+    }
+    return n;
 }
 
-/* get_cover_for_item - tries to load cover for covitem from local cache; starts download if not */
+/* dispatch_transfers - start queued transfers until the concurrency limit is reached */
 
-static gboolean find_cover_for_item (gpointer data)
+static void dispatch_transfers (void)
 {
-    int dl;
-    gchar *cpath, *clpath;
+    // the limit is on connections, so a split download holds back the queue until its segments finish
+    while (transfer_connections () < max_transfers && !g_queue_is_empty (&pending_xfers))
+        begin_transfer (g_queue_pop_head (&pending_xfers));
+}
+
+/* begin_transfer - open the file for a transfer and add it to the multi handle */
 
-    if (pdf_dl_req)
+static void begin_transfer (transfer_t *xfer)
+{
+    // a resumable transfer carries on from whatever its journal says is already there
+    if (xfer->flags & XFER_RESUMABLE)
     {
-        get_pending_pdf ();
-        return FALSE;
+        xfer->offset = load_journal (xfer);
+        xfer->journalled = xfer->offset;
+        if (!xfer->offset) remove (xfer->tmpname);
+        xfer->fd = open (xfer->tmpname, O_RDWR | O_CREAT, 0644);
     }
-
-    gtk_tree_model_get (GTK_TREE_MODEL (items), &covitem, ITEM_COVPATH, &cpath, ITEM_DOWNLOADED, &dl, -1);
-    clpath = get_local_path (cpath, CACHE_PATH);
-    if (access (clpath, F_OK) != -1)
+    else xfer->fd = open (xfer->tmpname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (xfer->fd == -1)
     {
-        update_cover_entry (clpath, dl, FALSE);
-        g_free (clpath);
-        g_free (cpath);
+        finish_curl_download (xfer);
+        return;
+    }
+    xfer->pos = xfer->offset;
 
-        if (gtk_tree_model_iter_next (GTK_TREE_MODEL (items), &covitem)) return TRUE;
-        else
+    // a resumed download has to read back what it already has to get the checksum up to date
+    if (xfer->hash)
+    {
+        xfer->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+        if (!advance_hash (xfer))
         {
-            cover_dl = FALSE;
-            refresh_icons ();
-            if (pdf_dl_req) get_pending_pdf ();
-            return FALSE;
+            finish_curl_download (xfer);
+            return;
         }
     }
-    else
+
+    setup_handle (xfer);
+    curl_easy_setopt (xfer->handle, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt (xfer->handle, CURLOPT_XFERINFOFUNCTION, progress_func);
+    curl_easy_setopt (xfer->handle, CURLOPT_XFERINFODATA, xfer);
+    if (xfer->flags & XFER_CONDITIONAL) load_validators (xfer);
+    if (xfer->offset)
     {
-        start_curl_download (cpath, clpath, image_download_done, NULL);
-        g_free (clpath);
-        g_free (cpath);
-        return FALSE;
+        // a plain range rather than RESUME_FROM, so a full response to a failed If-Range is accepted
+        xfer->range = g_strdup_printf ("%" CURL_FORMAT_CURL_OFF_T "-", xfer->offset);
+        curl_easy_setopt (xfer->handle, CURLOPT_RANGE, xfer->range);
     }
+    if (xfer->headers) curl_easy_setopt (xfer->handle, CURLOPT_HTTPHEADER, xfer->headers);
+
+    // adding the handle calls the timer function, which kicks off the transfer from the main loop
+    active_xfers = g_list_append (active_xfers, xfer);
+    curl_multi_add_handle (multi_handle, xfer->handle);
 }
 
-/* image_download_done - called on completed curl image download */
+/* setup_handle - get an easy handle for a transfer or segment and set the options they all share */
 
-static void image_download_done (tf_status success)
+static void setup_handle (transfer_t *xfer)
 {
-    gchar *cpath, *clpath;
-    int dl;
-
-    if (success == SUCCESS)
+    // reuse a finished easy handle if there is one - reset clears options but keeps its caches
+    if (idle_handles)
     {
-        gtk_tree_model_get (GTK_TREE_MODEL (items), &covitem, ITEM_COVPATH, &cpath, ITEM_DOWNLOADED, &dl, -1);
-        clpath = get_local_path (cpath, CACHE_PATH);
-        update_cover_entry (clpath, dl, TRUE);
-        g_free (clpath);
-        g_free (cpath);
+        xfer->handle = idle_handles->data;
+        idle_handles = g_slist_delete_link (idle_handles, idle_handles);
+        curl_easy_reset (xfer->handle);
     }
-
-    if (gtk_tree_model_iter_next (GTK_TREE_MODEL (items), &covitem))
-       g_idle_add (find_cover_for_item, NULL);
-    else
+    else xfer->handle = curl_easy_init ();
+
+    curl_easy_setopt (xfer->handle, CURLOPT_SHARE, share_handle);
+    curl_easy_setopt (xfer->handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt (xfer->handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt (xfer->handle, CURLOPT_URL, xfer->url);
+    curl_easy_setopt (xfer->handle, CURLOPT_USERAGENT, USER_AGENT);
+    curl_easy_setopt (xfer->handle, CURLOPT_WRITEFUNCTION, write_func);
+    curl_easy_setopt (xfer->handle, CURLOPT_WRITEDATA, xfer);
+    curl_easy_setopt (xfer->handle, CURLOPT_PRIVATE, xfer);
+    curl_easy_setopt (xfer->handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt (xfer->handle, CURLOPT_HEADERFUNCTION, header_func);
+    curl_easy_setopt (xfer->handle, CURLOPT_HEADERDATA, xfer);
+    if (xfer->auth_key)
     {
-        cover_dl = FALSE;
-        refresh_icons ();
-        if (pdf_dl_req) get_pending_pdf ();
+        curl_easy_setopt (xfer->handle, CURLOPT_HTTPAUTH, CURLAUTH_BEARER);
+        curl_easy_setopt (xfer->handle, CURLOPT_XOAUTH2_BEARER, xfer->auth_key);
     }
 }
 
+/* release_handle - take a transfer or segment's easy handle off the multi handle and keep it for reuse */
 
-/*----------------------------------------------------------------------------*/
-/* PDF handling                                                               */
-/*----------------------------------------------------------------------------*/
+static void release_handle (transfer_t *xfer)
+{
+    long nconn;
+
+    if (!xfer->handle) return;
+
+    // a transfer which needed no new connection went over one already open
+    if (curl_easy_getinfo (xfer->handle, CURLINFO_NUM_CONNECTS, &nconn) == CURLE_OK)
+    {
+        if (nconn) conns_opened += nconn;
+        else conns_reused++;
+    }
+
+    curl_multi_remove_handle (multi_handle, xfer->handle);
+    idle_handles = g_slist_prepend (idle_handles, xfer->handle);
+    xfer->handle = NULL;
+}
+
+/* split_transfer - once a large download has started, hand all but the first of parts to segments fetching ranges alongside it */
+
+static void split_transfer (transfer_t *xfer, int parts)
+{
+    transfer_t *seg;
+    curl_off_t step;
+    char *hdr;
+    int i;
+
+    // every segment must get the same version of the file as the first, so they send its validator with If-Range
+    if (xfer->etag && strncmp (xfer->etag, "W/", 2)) hdr = g_strdup_printf ("If-Range: %s", xfer->etag);
+    else if (xfer->lastmod) hdr = g_strdup_printf ("If-Range: %s", xfer->lastmod);
+    else return;
+
+    step = (xfer->total - xfer->pos) / parts;
+    xfer->end = xfer->pos + step;
+    for (i = 1; i < parts; i++)
+    {
+        seg = g_new0 (transfer_t, 1);
+        seg->parent = xfer;
+        seg->url = g_strdup (xfer->url);
+        seg->auth_key = g_strdup (xfer->auth_key);
+        seg->offset = seg->pos = xfer->end + (i - 1) * step;
+        seg->end = i == parts - 1 ? xfer->total : seg->offset + step;
+        seg->range = g_strdup_printf ("%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, seg->offset, seg->end - 1);
+        seg->headers = curl_slist_append (NULL, hdr);
+        seg->downstat = FAILURE;
+        seg->fd = -1;
+        xfer->segments = g_list_append (xfer->segments, seg);
+    }
+    g_free (hdr);
+}
+
+/* start_segments - add the handles for newly split downloads; curl does not allow this from inside its own callbacks */
+
+static void start_segments (void)
+{
+    transfer_t *seg;
+    GList *l, *sl;
+
+    for (l = active_xfers; l; l = l->next)
+    {
+        for (sl = ((transfer_t *) l->data)->segments; sl; sl = sl->next)
+        {
+            seg = sl->data;
+            if (seg->handle || seg->done) continue;
+
+            setup_handle (seg);
+
+            // separate HTTP/1.1 connections, as the point is to not share one TCP stream
+            curl_easy_setopt (seg->handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+            curl_easy_setopt (seg->handle, CURLOPT_PIPEWAIT, 0L);
+            curl_easy_setopt (seg->handle, CURLOPT_RANGE, seg->range);
+            curl_easy_setopt (seg->handle, CURLOPT_HTTPHEADER, seg->headers);
+            curl_multi_add_handle (multi_handle, seg->handle);
+        }
+    }
+}
+
+/* contiguous_bytes - how much of a download is in the file with no gaps, from the start */
+
+static curl_off_t contiguous_bytes (transfer_t *xfer)
+{
+    transfer_t *seg;
+    curl_off_t bytes = xfer->pos, end = xfer->end;
+    GList *l;
+
+    // each segment starts where the one before it ends, so carry on only through those which are full
+    for (l = xfer->segments; l && bytes == end; l = l->next)
+    {
+        seg = l->data;
+        bytes = seg->pos;
+        end = seg->end;
+    }
+    return bytes;
+}
+
+/* transfer_complete - check whether a download and all of its segments have finished */
+
+static gboolean transfer_complete (transfer_t *xfer)
+{
+    GList *l;
+
+    if (!xfer->done) return FALSE;
+    for (l = xfer->segments; l; l = l->next)
+        if (!((transfer_t *) l->data)->done) return FALSE;
+    return TRUE;
+}
+
+/* curl_socket_cb - curl callback to add, change or remove the main loop watch on a socket */
+
+static int curl_socket_cb (CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+    guint watch = GPOINTER_TO_UINT (socketp);
+    GIOCondition cond = 0;
+
+    if (watch) g_source_remove (watch);
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        curl_multi_assign (multi_handle, s, NULL);
+        return 0;
+    }
+
+    if (what & CURL_POLL_IN) cond |= G_IO_IN;
+    if (what & CURL_POLL_OUT) cond |= G_IO_OUT;
+    watch = g_unix_fd_add (s, cond | G_IO_ERR | G_IO_HUP, curl_socket_event, NULL);
+    curl_multi_assign (multi_handle, s, GUINT_TO_POINTER (watch));
+    return 0;
+}
+
+/* curl_timer_cb - curl callback to set or cancel the single timeout it needs */
+
+static int curl_timer_cb (CURLM *multi, long timeout_ms, void *userp)
+{
+    if (curl_timer) g_source_remove (curl_timer);
+    curl_timer = 0;
+
+    // a zero timeout still goes through the main loop, as curl must not be called back into from here
+    if (timeout_ms >= 0) curl_timer = g_timeout_add (timeout_ms, curl_timeout, NULL);
+    return 0;
+}
+
+/* curl_socket_event - main loop callback when a socket curl is waiting on becomes ready */
+
+static gboolean curl_socket_event (gint fd, GIOCondition cond, gpointer data)
+{
+    int still_running, action = 0;
+
+    if (cond & G_IO_IN) action |= CURL_CSELECT_IN;
+    if (cond & G_IO_OUT) action |= CURL_CSELECT_OUT;
+    if (cond & (G_IO_ERR | G_IO_HUP)) action |= CURL_CSELECT_ERR;
+
+    // curl removes or replaces this watch through curl_socket_cb if it no longer wants it
+    check_transfers (curl_multi_socket_action (multi_handle, fd, action, &still_running));
+    return G_SOURCE_CONTINUE;
+}
+
+/* curl_timeout - main loop callback when curl's timeout expires */
+
+static gboolean curl_timeout (gpointer data)
+{
+    int still_running;
+
+    curl_timer = 0;
+    check_transfers (curl_multi_socket_action (multi_handle, CURL_SOCKET_TIMEOUT, 0, &still_running));
+    return G_SOURCE_REMOVE;
+}
+
+/* check_transfers - complete any transfers which have finished and start queued ones */
+
+static void check_transfers (CURLMcode res)
+{
+    transfer_t *xfer, *dl;
+    CURLMsg *msg;
+    GList *l;
+    long code;
+    int nmsgs;
+
+    if (res != CURLM_OK)
+    {
+        // the multi handle is unusable - fail everything on it
+        while ((l = active_xfers)) finish_curl_download (l->data);
+    }
+    else
+    {
+        while ((msg = curl_multi_info_read (multi_handle, &nmsgs)))
+        {
+            if (msg->msg != CURLMSG_DONE) continue;
+            curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &xfer);
+            dl = xfer->parent ? xfer->parent : xfer;
+
+            // a split part is stopped by its write callback on reaching the next part, which curl reports as an error
+            if (msg->data.result == CURLE_OK || (xfer->end && xfer->pos == xfer->end))
+            {
+                code = 0;
+                curl_easy_getinfo (xfer->handle, CURLINFO_RESPONSE_CODE, &code);
+                if (xfer == dl) dl->downstat = code == 304 ? UNCHANGED : SUCCESS;
+                xfer->done = TRUE;
+            }
+            else
+            {
+                g_warning ("curl error %d (%s) for %s", msg->data.result, curl_easy_strerror (msg->data.result), xfer->url);
+                if (dl->downstat == SUCCESS) dl->downstat = FAILURE;
+            }
+
+            // the whole download finishes when the last part does, or as soon as any part fails
+            if (xfer != dl) release_handle (xfer);
+            if (!xfer->done || transfer_complete (dl)) finish_curl_download (dl);
+            else if (xfer == dl) release_handle (xfer);
+        }
+    }
+
+    start_segments ();
+    dispatch_transfers ();
+}
+
+/* finish_curl_download - close out a transfer, keep or discard its file and call its termination function */
+
+static void finish_curl_download (transfer_t *xfer)
+{
+    curl_off_t bytes;
+    long code = 0;
+    GList *l;
+
+    if (xfer->handle) curl_easy_getinfo (xfer->handle, CURLINFO_RESPONSE_CODE, &code);
+    release_handle (xfer);
+    active_xfers = g_list_remove (active_xfers, xfer);
+
+    // a file which does not match the catalogue is no use, and neither is any of it for resuming; checked while the
+    // segments are still there, as they say how much of the file has arrived
+    bytes = contiguous_bytes (xfer);
+    if (xfer->downstat == SUCCESS && xfer->checksum && !check_hash (xfer))
+    {
+        g_warning ("checksum mismatch for %s", xfer->url);
+        xfer->downstat = FAILURE;
+        bytes = 0;
+    }
+
+    // stop any segments still running - what they wrote stays in the file, but only the unbroken start of it is kept
+    for (l = xfer->segments; l; l = l->next)
+    {
+        release_handle (l->data);
+        free_transfer (l->data);
+    }
+    g_list_free (xfer->segments);
+    xfer->segments = NULL;
+
+    if (xfer->downstat == SUCCESS)
+    {
+        rename (xfer->tmpname, xfer->fname);
+        if (xfer->flags & XFER_CONDITIONAL) save_validators (xfer);
+        if (xfer->flags & XFER_RESUMABLE) discard_journal (xfer);
+    }
+    else if (!(xfer->flags & XFER_RESUMABLE) || code == 416 || !save_journal (xfer, bytes))
+    {
+        // nothing worth resuming, or the server cannot satisfy a resume of what is there
+        remove (xfer->tmpname);
+        if (xfer->flags & XFER_RESUMABLE) discard_journal (xfer);
+    }
+    if (xfer->fd != -1) close (xfer->fd);
+
+    // the time on the validators records when the file was last known to be current
+    if (xfer->downstat == UNCHANGED) touch_validators (xfer->fname);
+
+    trace_end ("download", xfer);
+    if (xfer->term_fn) xfer->term_fn (xfer->downstat, xfer->data);
+    free_transfer (xfer);
+}
+
+/* free_transfer - release the state of a finished transfer */
+
+static void free_transfer (transfer_t *xfer)
+{
+    curl_slist_free_all (xfer->headers);
+    g_free (xfer->etag);
+    g_free (xfer->lastmod);
+    g_free (xfer->url);
+    g_free (xfer->fname);
+    g_free (xfer->tmpname);
+    g_free (xfer->auth_key);
+    g_free (xfer->range);
+    g_free (xfer->hash);
+    if (xfer->checksum) g_checksum_free (xfer->checksum);
+    g_free (xfer);
+}
+
+/* validator_key - identifies what was requested, so validators are only sent for the same URL and credentials */
+
+static char *validator_key (transfer_t *xfer)
+{
+    char *key, *hash;
+
+    key = g_strdup_printf ("%s %s", xfer->url, xfer->auth_key ? xfer->auth_key : "");
+    hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+    g_free (key);
+    return hash;
+}
+
+/* load_validators - read the ETag and Last-Modified stored for the file and add the matching request headers */
+
+static void load_validators (transfer_t *xfer)
+{
+    GKeyFile *kf;
+    char *path, *key, *skey, *val, *hdr;
+
+    // validators are no use without the file they describe
+    if (access (xfer->fname, F_OK) == -1) return;
+
+    path = g_strdup_printf ("%s.meta", xfer->fname);
+    kf = g_key_file_new ();
+    if (g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, NULL))
+    {
+        key = validator_key (xfer);
+        skey = g_key_file_get_string (kf, "Validators", "Key", NULL);
+        if (!g_strcmp0 (key, skey))
+        {
+            if ((val = g_key_file_get_string (kf, "Validators", "ETag", NULL)))
+            {
+                hdr = g_strdup_printf ("If-None-Match: %s", val);
+                xfer->headers = curl_slist_append (xfer->headers, hdr);
+                g_free (hdr);
+                g_free (val);
+            }
+            if ((val = g_key_file_get_string (kf, "Validators", "LastModified", NULL)))
+            {
+                hdr = g_strdup_printf ("If-Modified-Since: %s", val);
+                xfer->headers = curl_slist_append (xfer->headers, hdr);
+                g_free (hdr);
+                g_free (val);
+            }
+        }
+        g_free (skey);
+        g_free (key);
+    }
+    g_key_file_free (kf);
+    g_free (path);
+}
+
+/* save_validators - store the ETag and Last-Modified returned with a file alongside it */
+
+static void save_validators (transfer_t *xfer)
+{
+    GKeyFile *kf;
+    char *path, *key;
+
+    path = g_strdup_printf ("%s.meta", xfer->fname);
+    if (xfer->etag || xfer->lastmod)
+    {
+        kf = g_key_file_new ();
+        key = validator_key (xfer);
+        g_key_file_set_string (kf, "Validators", "Key", key);
+        if (xfer->etag) g_key_file_set_string (kf, "Validators", "ETag", xfer->etag);
+        if (xfer->lastmod) g_key_file_set_string (kf, "Validators", "LastModified", xfer->lastmod);
+        g_key_file_save_to_file (kf, path, NULL);
+        g_key_file_free (kf);
+        g_free (key);
+    }
+    else remove (path);
+    g_free (path);
+}
+
+/* discard_validators - remove the validators stored for a file */
+
+static void discard_validators (char *file)
+{
+    char *path = g_strdup_printf ("%s.meta", file);
+    remove (path);
+    g_free (path);
+}
+
+/* touch_validators - record that the server has just confirmed a file is unchanged */
+
+static void touch_validators (char *file)
+{
+    char *path = g_strdup_printf ("%s.meta", file);
+    utimensat (AT_FDCWD, path, NULL, 0);
+    g_free (path);
+}
+
+/* load_journal - add a range request for the partial file if its journal is for the same URL; returns bytes to skip */
+
+static curl_off_t load_journal (transfer_t *xfer)
+{
+    GKeyFile *kf;
+    char *path, *key, *skey, *etag, *lastmod, *hdr = NULL;
+    curl_off_t bytes = 0;
+
+    path = g_strdup_printf ("%s.journal", xfer->fname);
+    kf = g_key_file_new ();
+    if (g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, NULL))
+    {
+        key = validator_key (xfer);
+        skey = g_key_file_get_string (kf, "Journal", "Key", NULL);
+        etag = g_key_file_get_string (kf, "Journal", "ETag", NULL);
+        lastmod = g_key_file_get_string (kf, "Journal", "LastModified", NULL);
+
+        // If-Range needs a strong validator, so the server sends the whole file if it has changed
+        if (etag && strncmp (etag, "W/", 2)) hdr = g_strdup_printf ("If-Range: %s", etag);
+        else if (lastmod) hdr = g_strdup_printf ("If-Range: %s", lastmod);
+
+        if (hdr && !g_strcmp0 (key, skey))
+        {
+            // the file may hold more than was journalled, but never trust it to hold less
+            bytes = MIN (g_key_file_get_int64 (kf, "Journal", "Bytes", NULL), file_size (xfer->tmpname));
+            if (bytes > 0 && truncate (xfer->tmpname, bytes) == 0)
+                xfer->headers = curl_slist_append (xfer->headers, hdr);
+            else bytes = 0;
+        }
+
+        g_free (hdr);
+        g_free (etag);
+        g_free (lastmod);
+        g_free (skey);
+        g_free (key);
+    }
+    g_key_file_free (kf);
+    g_free (path);
+
+    if (!bytes) discard_journal (xfer);
+    return bytes;
+}
+
+/* save_journal - record how much of a resumable transfer has been received, and the validators it came with */
+
+static gboolean save_journal (transfer_t *xfer, curl_off_t bytes)
+{
+    GKeyFile *kf;
+    char *path, *key;
+    gboolean res;
+
+    if (bytes <= 0 || (!xfer->etag && !xfer->lastmod)) return FALSE;
+
+    // the data must reach the disk before the journal does, or a power cut could leave it claiming bytes that were lost
+    if (xfer->fd != -1 && fdatasync (xfer->fd) == -1) return FALSE;
+
+    kf = g_key_file_new ();
+    key = validator_key (xfer);
+    g_key_file_set_string (kf, "Journal", "Key", key);
+    g_key_file_set_string (kf, "Journal", "URL", xfer->url);
+    if (xfer->etag) g_key_file_set_string (kf, "Journal", "ETag", xfer->etag);
+    if (xfer->lastmod) g_key_file_set_string (kf, "Journal", "LastModified", xfer->lastmod);
+    g_key_file_set_int64 (kf, "Journal", "Bytes", bytes);
+
+    // saved by writing a new file and renaming it over the old, so a crash leaves one or the other
+    path = g_strdup_printf ("%s.journal", xfer->fname);
+    res = g_key_file_save_to_file (kf, path, NULL);
+    if (res) xfer->journalled = bytes;
+
+    g_free (path);
+    g_free (key);
+    g_key_file_free (kf);
+    return res;
+}
+
+/* discard_journal - forget a partial download */
+
+static void discard_journal (transfer_t *xfer)
+{
+    char *path = g_strdup_printf ("%s.journal", xfer->fname);
+    remove (path);
+    g_free (path);
+}
+
+/* write_func - curl callback to write received data at the transfer or segment's own position in the file */
+
+static size_t write_func (char *ptr, size_t size, size_t nmemb, transfer_t *xfer)
+{
+    transfer_t *dl = xfer->parent ? xfer->parent : xfer;
+    size_t len = size * nmemb, done;
+    ssize_t n;
+
+    // a part which has reached the next one stops - returning short ends its request
+    if (xfer->end && xfer->pos + (curl_off_t) len > xfer->end) len = xfer->end - xfer->pos;
+
+    for (done = 0; done < len; done += n)
+    {
+        n = pwrite (dl->fd, ptr + done, len - done, xfer->pos + done);
+        if (n == -1 && errno == EINTR) n = 0;
+        else if (n <= 0)
+        {
+            if (errno == ENOSPC) dl->downstat = NOSPACE;
+            return 0;
+        }
+    }
+
+    // data arriving at the end of what has been checksummed is hashed straight from curl's buffer
+    if (dl->checksum && xfer->pos == dl->hashed)
+    {
+        g_checksum_update (dl->checksum, (const guchar *) ptr, len);
+        dl->hashed += len;
+    }
+    xfer->pos += len;
+
+    // if that completed a part, segments after it will have data on disk which has not been hashed yet
+    if (dl->checksum && !advance_hash (dl)) return 0;
+    transfer_written (dl);
+    return len;
+}
+
+/* transfer_written - update progress and the journal after data has been written for a download */
+
+static void transfer_written (transfer_t *xfer)
+{
+    curl_off_t have = xfer->pos, bytes;
+    transfer_t *seg;
+    GList *l;
+
+    if (xfer->total <= 0) return;
+    for (l = xfer->segments; l; l = l->next)
+    {
+        seg = l->data;
+        have += seg->pos - seg->offset;
+    }
+    if (xfer->flags & XFER_MODAL) set_progress ((double) have / xfer->total);
+    if (xfer->flags & XFER_ITEM) set_item_progress (xfer, have * 100 / xfer->total);
+
+    // save_journal flushes the file first, so the journal never claims more than the disk holds
+    if (xfer->flags & XFER_RESUMABLE)
+    {
+        bytes = contiguous_bytes (xfer);
+        if (bytes - xfer->journalled >= JOURNAL_STEP) save_journal (xfer, bytes);
+    }
+}
+
+/* advance_hash - bring a download's checksum up to the end of its contiguous data, reading back anything not yet seen */
+
+static gboolean advance_hash (transfer_t *xfer)
+{
+    guchar buf[HASH_CHUNK];
+    curl_off_t end = contiguous_bytes (xfer);
+    ssize_t n;
+
+    while (xfer->hashed < end)
+    {
+        n = pread (xfer->fd, buf, MIN (end - xfer->hashed, HASH_CHUNK), xfer->hashed);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return FALSE;
+        g_checksum_update (xfer->checksum, buf, n);
+        xfer->hashed += n;
+    }
+    return TRUE;
+}
+
+/* check_hash - compare the checksum of a completed download with the one in the catalogue */
+
+static gboolean check_hash (transfer_t *xfer)
+{
+    // the first part of a split download stops short of the end, so the whole file is measured by its segments
+    if (!advance_hash (xfer) || xfer->hashed != contiguous_bytes (xfer)) return FALSE;
+    if (xfer->total > 0 && xfer->hashed != xfer->total) return FALSE;
+    return !g_ascii_strcasecmp (g_checksum_get_string (xfer->checksum), xfer->hash);
+}
+
+/* header_func - curl callback for each response header line; records the validators */
+
+static size_t header_func (char *buffer, size_t size, size_t nitems, transfer_t *xfer)
+{
+    size_t len = size * nitems;
+    char *line, *val;
+    curl_off_t clen;
+    long code = 0;
+    int parts;
+
+    line = g_strndup (buffer, len);
+    g_strstrip (line);
+
+    // a status line starts a new response (eg after a redirect), so forget anything from the last one
+    if (!strncmp (line, "HTTP/", 5))
+    {
+        g_clear_pointer (&xfer->etag, g_free);
+        g_clear_pointer (&xfer->lastmod, g_free);
+        xfer->accept_ranges = FALSE;
+    }
+    else if (!*line)
+    {
+        curl_easy_getinfo (xfer->handle, CURLINFO_RESPONSE_CODE, &code);
+
+        // a segment must get the range it asked for - anything else means the file changed under it
+        if (xfer->parent)
+        {
+            if (code >= 200 && code < 300 && code != 206) len = 0;
+            g_free (line);
+            return len;
+        }
+
+        // a full response to a range request means the file has changed, so start again from the beginning
+        if (code == 200 && xfer->offset)
+        {
+            if (ftruncate (xfer->fd, 0) == 0)
+            {
+                xfer->offset = xfer->pos = 0;
+                xfer->journalled = 0;
+                discard_journal (xfer);
+                if (xfer->checksum)
+                {
+                    g_checksum_reset (xfer->checksum);
+                    xfer->hashed = 0;
+                }
+            }
+            else len = 0;
+        }
+
+        if ((code == 200 || code == 206)
+            && curl_easy_getinfo (xfer->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &clen) == CURLE_OK && clen > 0)
+            xfer->total = xfer->pos + clen;
+
+        // end of the headers - returning short aborts the transfer before any of the body arrives
+        if (len && !reserve_space (xfer)) len = 0;
+
+        // segments only take connections which are free, so splitting never goes over the transfer limit
+        parts = MIN (max_segments, max_transfers - transfer_connections () + 1);
+        if (len && (xfer->flags & XFER_SEGMENTED) && (code == 206 || xfer->accept_ranges) && parts > 1
+            && xfer->total - xfer->pos >= SEGMENT_MIN)
+            split_transfer (xfer, parts);
+    }
+    else if ((val = strchr (line, ':')))
+    {
+        *val++ = 0;
+        while (*val == ' ') val++;
+        if (!g_ascii_strcasecmp (line, "ETag"))
+        {
+            g_free (xfer->etag);
+            xfer->etag = g_strdup (val);
+        }
+        else if (!g_ascii_strcasecmp (line, "Last-Modified"))
+        {
+            g_free (xfer->lastmod);
+            xfer->lastmod = g_strdup (val);
+        }
+        else if (!g_ascii_strcasecmp (line, "Accept-Ranges"))
+            xfer->accept_ranges = !g_ascii_strcasecmp (val, "bytes");
+    }
+
+    g_free (line);
+    return len;
+}
+
+/* reserve_space - once the length of a response is known, check it will fit and allocate the disk space for it */
+
+static gboolean reserve_space (transfer_t *xfer)
+{
+    curl_off_t len = xfer->total - xfer->pos;
+
+    if (xfer->total <= 0 || len <= 0) return TRUE;
+
+    if (len + MIN_SPACE >= free_space (xfer->tmpname))
+    {
+        xfer->downstat = NOSPACE;
+        return FALSE;
+    }
+
+    // keeping the size means a failed download still only leaves what was actually written
+    if (fallocate (xfer->fd, FALLOC_FL_KEEP_SIZE, xfer->pos, len) == -1 && errno == ENOSPC)
+    {
+        xfer->downstat = NOSPACE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int progress_func (transfer_t *xfer, curl_off_t t, curl_off_t d, curl_off_t ultotal, curl_off_t ulnow)
+{
+    if ((xfer->flags & XFER_MODAL) && cancelled)
+    {
+        xfer->downstat = CANCELLED;
+        return 1;
+    }
+    return 0;
+}
+
+/* set_progress - record the download fraction, redrawing the progress bar at most once a frame */
+
+static void set_progress (double fraction)
+{
+    pb_fraction = fraction;
+    if (gtk_widget_get_visible (msg_dlg) && !pb_tick) pb_tick = gtk_widget_add_tick_callback (msg_pb, update_progress, NULL, progress_done);
+}
+
+static gboolean update_progress (GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (widget), pb_fraction);
+    return G_SOURCE_REMOVE;
+}
+
+static void progress_done (gpointer data)
+{
+    pb_tick = 0;
+}
+
+/* set_item_progress - show the percentage downloaded on the item's tile, only touching the shelf when it changes */
+
+static void set_item_progress (transfer_t *xfer, int percent)
+{
+    int idx;
+
+    if (percent == xfer->percent) return;
+    xfer->percent = percent;
+    if ((idx = find_item (xfer->url)) == -1) return;
+    g_array_index (shelf->items, item_t, idx).progress = percent;
+    item_changed (idx);
+}
+
+
+/*----------------------------------------------------------------------------*/
+/* Cover pixel kernels                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* accumulate_row - add a row of 8-bit samples times a weight into a 16-bit accumulator */
+
+static void accumulate_row_c (guint16 *acc, const guint8 *src, int len, guint16 weight)
+{
+    int i;
+
+    for (i = 0; i < len; i++) acc[i] += src[i] * weight;
+}
+
+/* blend_span - dst = pre + dst * inv / 255, rounded, for a run of bytes */
+
+static void blend_span_c (guint8 *dst, const guint8 *pre, const guint8 *inv, int len)
+{
+    unsigned int t;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        t = dst[i] * inv[i] + 128;
+        dst[i] = pre[i] + ((t + (t >> 8)) >> 8);
+    }
+}
+
+#ifdef USE_SSE2
+SSE2_FN static void accumulate_row_sse2 (guint16 *acc, const guint8 *src, int len, guint16 weight)
+{
+    __m128i w = _mm_set1_epi16 (weight), zero = _mm_setzero_si128 (), s, a;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        s = _mm_loadu_si128 ((const __m128i *) (src + i));
+        a = _mm_loadu_si128 ((const __m128i *) (acc + i));
+        _mm_storeu_si128 ((__m128i *) (acc + i), _mm_add_epi16 (a, _mm_mullo_epi16 (_mm_unpacklo_epi8 (s, zero), w)));
+        a = _mm_loadu_si128 ((const __m128i *) (acc + i + 8));
+        _mm_storeu_si128 ((__m128i *) (acc + i + 8), _mm_add_epi16 (a, _mm_mullo_epi16 (_mm_unpackhi_epi8 (s, zero), w)));
+    }
+    accumulate_row_c (acc + i, src + i, len - i, weight);
+}
+
+SSE2_FN static void blend_span_sse2 (guint8 *dst, const guint8 *pre, const guint8 *inv, int len)
+{
+    __m128i zero = _mm_setzero_si128 (), half = _mm_set1_epi16 (128), d, v, lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        d = _mm_loadu_si128 ((const __m128i *) (dst + i));
+        v = _mm_loadu_si128 ((const __m128i *) (inv + i));
+        lo = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (d, zero), _mm_unpacklo_epi8 (v, zero)), half);
+        hi = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (d, zero), _mm_unpackhi_epi8 (v, zero)), half);
+        lo = _mm_srli_epi16 (_mm_add_epi16 (lo, _mm_srli_epi16 (lo, 8)), 8);
+        hi = _mm_srli_epi16 (_mm_add_epi16 (hi, _mm_srli_epi16 (hi, 8)), 8);
+        d = _mm_adds_epu8 (_mm_packus_epi16 (lo, hi), _mm_loadu_si128 ((const __m128i *) (pre + i)));
+        _mm_storeu_si128 ((__m128i *) (dst + i), d);
+    }
+    blend_span_c (dst + i, pre + i, inv + i, len - i);
+}
+#endif
+
+#ifdef USE_NEON
+NEON_FN static void accumulate_row_neon (guint16 *acc, const guint8 *src, int len, guint16 weight)
+{
+    uint16x8_t w = vdupq_n_u16 (weight);
+    uint8x16_t s;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        s = vld1q_u8 (src + i);
+        vst1q_u16 (acc + i, vmlaq_u16 (vld1q_u16 (acc + i), vmovl_u8 (vget_low_u8 (s)), w));
+        vst1q_u16 (acc + i + 8, vmlaq_u16 (vld1q_u16 (acc + i + 8), vmovl_u8 (vget_high_u8 (s)), w));
+    }
+    accumulate_row_c (acc + i, src + i, len - i, weight);
+}
+
+NEON_FN static void blend_span_neon (guint8 *dst, const guint8 *pre, const guint8 *inv, int len)
+{
+    uint8x16_t d, v;
+    uint16x8_t lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        d = vld1q_u8 (dst + i);
+        v = vld1q_u8 (inv + i);
+        lo = vmull_u8 (vget_low_u8 (d), vget_low_u8 (v));
+        hi = vmull_u8 (vget_high_u8 (d), vget_high_u8 (v));
+        d = vcombine_u8 (vraddhn_u16 (lo, vrshrq_n_u16 (lo, 8)), vraddhn_u16 (hi, vrshrq_n_u16 (hi, 8)));
+        vst1q_u8 (dst + i, vqaddq_u8 (d, vld1q_u8 (pre + i)));
+    }
+    blend_span_c (dst + i, pre + i, inv + i, len - i);
+}
+
+/* cpu_has_neon - always there on 64-bit ARM, but optional on the 32-bit cores armhf also runs on */
+
+static gboolean cpu_has_neon (void)
+{
+#ifdef __aarch64__
+    return TRUE;
+#else
+    return (getauxval (AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+#endif
+
+/* init_kernels - pick the fastest kernels this CPU can run, and prepare the overlays for them */
+
+static void init_kernels (void)
+{
+    const char *name = "scalar";
+
+    accumulate_row = accumulate_row_c;
+    blend_span = blend_span_c;
+
+#ifdef USE_SSE2
+    if (__builtin_cpu_supports ("sse2"))
+    {
+        accumulate_row = accumulate_row_sse2;
+        blend_span = blend_span_sse2;
+        name = "SSE2";
+    }
+#endif
+#ifdef USE_NEON
+    if (cpu_has_neon ())
+    {
+        accumulate_row = accumulate_row_neon;
+        blend_span = blend_span_neon;
+        name = "NEON";
+    }
+#endif
+    if (g_getenv ("RP_BOOKSHELF_SCALAR"))
+    {
+        accumulate_row = accumulate_row_c;
+        blend_span = blend_span_c;
+        name = "scalar";
+    }
+    g_debug ("Using %s cover kernels", name);
+
+    make_layer (&grey_layer, grey, 128);
+    make_layer (&cloud_layer, cloud, 255);
+    make_layer (&padlock_layer, padlock, 255);
+    make_layer (&newcorn_layer, newcorn, 255);
+}
+
+/* box_taps - weights of the input pixels covered by each of dst output pixels when shrinking src to dst */
+
+static box_taps_t *box_taps (int src, int dst)
+{
+    box_taps_t *taps;
+    gint64 start, end, lo, hi;
+    int i, j;
+
+    taps = g_new (box_taps_t, dst);
+    for (i = 0; i < dst; i++)
+    {
+        // positions are in units of 1/dst of an input pixel
+        start = (gint64) i * src;
+        end = start + src;
+        taps[i].first = start / dst;
+        taps[i].count = (end + dst - 1) / dst - taps[i].first;
+        taps[i].weights = g_new (guint16, taps[i].count);
+
+        // rounding the running total keeps the weights summing to exactly 256
+        for (j = 0; j < taps[i].count; j++)
+        {
+            lo = MAX (start, (gint64) (taps[i].first + j) * dst) - start;
+            hi = MIN (end, (gint64) (taps[i].first + j + 1) * dst) - start;
+            taps[i].weights[j] = (hi * 256 + src / 2) / src - (lo * 256 + src / 2) / src;
+        }
+    }
+    return taps;
+}
+
+static void free_taps (box_taps_t *taps, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) g_free (taps[i].weights);
+    g_free (taps);
+}
+
+/* scale_cover - shrink an opaque RGB pixbuf with a box filter, summing input rows and then columns for each output row */
+
+static GdkPixbuf *scale_cover (GdkPixbuf *pb, int dw, int dh)
+{
+    GdkPixbuf *spb;
+    box_taps_t *xt, *yt;
+    const guint8 *src;
+    guint8 *dst;
+    guint16 *acc;
+    guint32 sum;
+    int sw, sh, srs, drs, x, y, k, c;
+
+    sw = gdk_pixbuf_get_width (pb);
+    sh = gdk_pixbuf_get_height (pb);
+    srs = gdk_pixbuf_get_rowstride (pb);
+    src = gdk_pixbuf_read_pixels (pb);
+
+    spb = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, dw, dh);
+    drs = gdk_pixbuf_get_rowstride (spb);
+    dst = gdk_pixbuf_get_pixels (spb);
+
+    xt = box_taps (sw, dw);
+    yt = box_taps (sh, dh);
+    acc = g_new (guint16, sw * 3);
+
+    for (y = 0; y < dh; y++)
+    {
+        // at most 255 * 256 in each sample, so the column sums fit in 16 bits
+        memset (acc, 0, sw * 3 * sizeof (guint16));
+        for (k = 0; k < yt[y].count; k++)
+            accumulate_row (acc, src + (gsize) (yt[y].first + k) * srs, sw * 3, yt[y].weights[k]);
+
+        for (x = 0; x < dw; x++)
+        {
+            for (c = 0; c < 3; c++)
+            {
+                sum = 0;
+                for (k = 0; k < xt[x].count; k++) sum += acc[(xt[x].first + k) * 3 + c] * xt[x].weights[k];
+                dst[y * drs + x * 3 + c] = (sum + 32768) >> 16;
+            }
+        }
+    }
+
+    g_free (acc);
+    free_taps (xt, dw);
+    free_taps (yt, dh);
+    return spb;
+}
+
+/* make_layer - premultiply an overlay pixbuf by its alpha and an overall alpha, ready for blend_span */
+
+static void make_layer (blend_layer_t *layer, GdkPixbuf *pb, int alpha)
+{
+    const guint8 *src, *p;
+    int x, y, c, a, ch, rs, off;
+
+    layer->width = gdk_pixbuf_get_width (pb);
+    layer->height = gdk_pixbuf_get_height (pb);
+    layer->pre = g_new (guint8, layer->width * layer->height * 3);
+    layer->inv = g_new (guint8, layer->width * layer->height * 3);
+
+    ch = gdk_pixbuf_get_n_channels (pb);
+    rs = gdk_pixbuf_get_rowstride (pb);
+    src = gdk_pixbuf_read_pixels (pb);
+
+    for (y = 0; y < layer->height; y++)
+    {
+        for (x = 0; x < layer->width; x++)
+        {
+            p = src + y * rs + x * ch;
+            a = gdk_pixbuf_get_has_alpha (pb) ? (p[3] * alpha + 127) / 255 : alpha;
+            off = (y * layer->width + x) * 3;
+            for (c = 0; c < 3; c++)
+            {
+                layer->pre[off + c] = (p[c] * a + 127) / 255;
+                layer->inv[off + c] = 255 - a;
+            }
+        }
+    }
+}
+
+/* blend_layer - blend an overlay onto an opaque RGB cover at x, y; returns FALSE if it would not fit */
+
+static gboolean blend_layer (GdkPixbuf *cover, const blend_layer_t *layer, int x, int y)
+{
+    guint8 *pix;
+    int rs, r, off;
+
+    if (gdk_pixbuf_get_n_channels (cover) != 3 || x < 0 || y < 0
+        || x + layer->width > gdk_pixbuf_get_width (cover) || y + layer->height > gdk_pixbuf_get_height (cover))
+        return FALSE;
+
+    rs = gdk_pixbuf_get_rowstride (cover);
+    pix = gdk_pixbuf_get_pixels (cover);
+    for (r = 0; r < layer->height; r++)
+    {
+        off = r * layer->width * 3;
+        blend_span (pix + (y + r) * rs + x * 3, layer->pre + off, layer->inv + off, layer->width * 3);
+    }
+    return TRUE;
+}
+
+/* overlay_cover - grey out an opaque RGB cover and put an icon in the middle of it, a row at a time */
+
+static gboolean overlay_cover (GdkPixbuf *cover, const blend_layer_t *icon)
+{
+    guint8 *pix;
+    int w, h, rs, ix, r, off;
+
+    w = gdk_pixbuf_get_width (cover);
+    h = gdk_pixbuf_get_height (cover);
+    ix = (w - icon->width) / 2;
+    if (gdk_pixbuf_get_n_channels (cover) != 3 || w > grey_layer.width || h > grey_layer.height
+        || ix < 0 || 32 + icon->height > h)
+        return FALSE;
+
+    rs = gdk_pixbuf_get_rowstride (cover);
+    pix = gdk_pixbuf_get_pixels (cover);
+    for (r = 0; r < h; r++)
+    {
+        off = r * grey_layer.width * 3;
+        blend_span (pix + r * rs, grey_layer.pre + off, grey_layer.inv + off, w * 3);
+        if (r >= 32 && r < 32 + icon->height)
+        {
+            off = (r - 32) * icon->width * 3;
+            blend_span (pix + r * rs + ix * 3, icon->pre + off, icon->inv + off, icon->width * 3);
+        }
+    }
+    return TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Cover cache                                                                */
+/*----------------------------------------------------------------------------*/
+
+/* cover_path - creates a string with the path a cover URL is cached at - named for a hash of the whole URL, so
+ * covers with the same file name in different places cannot collide, and spread over subdirectories by its first byte */
+
+static char *cover_path (const char *url)
+{
+    char *hash, *path;
+
+    hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, url, -1);
+    path = g_strdup_printf ("%s%s%.2s/%s", g_get_home_dir (), COVER_PATH, hash, hash);
+    g_free (hash);
+    return path;
+}
+
+/* cover_stale - whether a cached cover is due to be checked with the server again */
+
+static gboolean cover_stale (const char *lpath)
+{
+    char *mpath;
+    gint64 checked;
+
+    // the validators are touched each time the server says the cover is unchanged
+    mpath = g_strdup_printf ("%s.meta", lpath);
+    checked = file_mtime (mpath, NULL);
+    if (checked == -1) checked = file_mtime (lpath, NULL);
+    g_free (mpath);
+    return checked != -1 && g_get_real_time () * 1000 - checked > (gint64) COVER_MAX_AGE * 1000000000;
+}
+
+/* mark_used - record that a cache file has been shown, for eviction */
+
+static void mark_used (const char *path)
+{
+    struct timespec ts[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+    struct stat st;
+
+    // access times are not kept on most mounts, so set explicitly - but only once a day, to spare the SD card
+    if (stat (path, &st) == -1 || time (NULL) - st.st_atime < USED_INTERVAL) return;
+    utimensat (AT_FDCWD, path, ts, 0);
+}
+
+/* add_cache_entries - list the files in a cache directory with their size and when they were last shown */
+
+static void add_cache_entries (GArray *entries, const char *dir, gint64 *total)
+{
+    DIR *dfd;
+    struct dirent *dp;
+    struct stat st;
+    cache_entry_t entry;
+    char *path, *mpath;
+
+    if (!(dfd = opendir (dir))) return;
+    while ((dp = readdir (dfd)))
+    {
+        if (dp->d_name[0] == '.' || g_str_has_suffix (dp->d_name, ".meta")) continue;
+        path = g_build_filename (dir, dp->d_name, NULL);
+        if (stat (path, &st) == -1 || !S_ISREG (st.st_mode))
+        {
+            g_free (path);
+            continue;
+        }
+
+        // a download left behind by a crash is removed, but one still in progress is not touched
+        if (g_str_has_suffix (dp->d_name, ".curl"))
+        {
+            if (time (NULL) - st.st_mtime >= USED_INTERVAL) remove (path);
+            g_free (path);
+            continue;
+        }
+
+        // validators are counted with their cover, and go with it
+        entry.path = path;
+        entry.size = st.st_size;
+        entry.used = st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime;
+        mpath = g_strdup_printf ("%s.meta", path);
+        if (stat (mpath, &st) != -1) entry.size += st.st_size;
+        g_free (mpath);
+
+        *total += entry.size;
+        g_array_append_val (entries, entry);
+    }
+    closedir (dfd);
+}
+
+/* compare_used - sort function putting the least recently shown cache entries first */
+
+static gint compare_used (gconstpointer a, gconstpointer b)
+{
+    const cache_entry_t *ea = a, *eb = b;
+
+    if (ea->used != eb->used) return ea->used < eb->used ? -1 : 1;
+    return 0;
+}
+
+/* trim_cache_thread - worker thread which evicts the least recently shown covers and thumbnails until under budget */
+
+static void trim_cache_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+    GArray *entries;
+    cache_entry_t *entry;
+    DIR *dfd;
+    struct dirent *dp;
+    char *dir, *path;
+    gint64 total = 0;
+    int i;
+
+    // covers from before the cache was keyed by URL hash are never looked at again
+    dir = g_build_filename (g_get_home_dir (), CACHE_PATH, NULL);
+    if ((dfd = opendir (dir)))
+    {
+        while ((dp = readdir (dfd)))
+        {
+            if (!g_str_has_suffix (dp->d_name, ".jpg") && !g_str_has_suffix (dp->d_name, ".jpeg")
+                && !g_str_has_suffix (dp->d_name, ".png")
+                && !g_str_has_suffix (dp->d_name, ".jpg.meta") && !g_str_has_suffix (dp->d_name, ".png.meta"))
+                continue;
+            path = g_build_filename (dir, dp->d_name, NULL);
+            remove (path);
+            g_free (path);
+        }
+        closedir (dfd);
+    }
+    g_free (dir);
+
+    entries = g_array_new (FALSE, FALSE, sizeof (cache_entry_t));
+    dir = g_build_filename (g_get_home_dir (), COVER_PATH, NULL);
+    if ((dfd = opendir (dir)))
+    {
+        while ((dp = readdir (dfd)))
+        {
+            if (dp->d_name[0] == '.') continue;
+            path = g_build_filename (dir, dp->d_name, NULL);
+            add_cache_entries (entries, path, &total);
+            g_free (path);
+        }
+        closedir (dfd);
+    }
+    g_free (dir);
+    dir = g_build_filename (g_get_home_dir (), THUMB_PATH, NULL);
+    add_cache_entries (entries, dir, &total);
+    g_free (dir);
+
+    if (total > cover_budget)
+    {
+        g_array_sort (entries, compare_used);
+        for (i = 0; i < entries->len && total > cover_budget; i++)
+        {
+            entry = &g_array_index (entries, cache_entry_t, i);
+            remove (entry->path);
+            discard_validators (entry->path);
+            total -= entry->size;
+        }
+        g_debug ("Cover cache trimmed to %" G_GINT64_FORMAT " bytes", total);
+    }
+
+    for (i = 0; i < entries->len; i++) g_free (g_array_index (entries, cache_entry_t, i).path);
+    g_array_free (entries, TRUE);
+    g_task_return_boolean (task, TRUE);
+}
+
+/* trim_cache - keep the cover cache within its budget, in the background */
+
+static void trim_cache (void)
+{
+    GTask *task;
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    g_task_run_in_thread (task, trim_cache_thread);
+    g_object_unref (task);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Cover art handling                                                         */
+/*----------------------------------------------------------------------------*/
+
+/* load_overlays - prepare the images drawn over covers, and the placeholders shown until covers are loaded */
+
+static void load_overlays (void)
+{
+    int w;
+
+    cloud = gdk_pixbuf_new_from_resource (RESOURCE_PATH "cloud.png", NULL);
+    grey = gdk_pixbuf_new_from_resource (RESOURCE_PATH "grey.png", NULL);
+    padlock = gdk_pixbuf_new_from_resource (RESOURCE_PATH "padlock.png", NULL);
+    newcorn = gdk_pixbuf_new_from_resource (RESOURCE_PATH "new.png", NULL);
+    nocover = gdk_pixbuf_new_from_resource (RESOURCE_PATH "nocover.png", NULL);
+    nodl = gdk_pixbuf_copy (nocover);
+    w = gdk_pixbuf_get_width (nodl);
+    gdk_pixbuf_composite (cloud, nodl, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
+    nolock = gdk_pixbuf_copy (nocover);
+    gdk_pixbuf_composite (padlock, nolock, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
+}
+
+/* get_cover - reads in cover from filename to pixbuf and scales */
+
+static GdkPixbuf *get_cover (const char *filename)
+{
+    GdkPixbuf *pb, *spb;
+    int w, h, dw, dh;
+    gint64 ts = trace_now ();
+    
+    pb = gdk_pixbuf_new_from_file (filename, NULL);
+    if (!pb) pb = gdk_pixbuf_new_from_resource (RESOURCE_PATH "nocover.png", NULL);
+
+    h = gdk_pixbuf_get_height (pb);
+    if (h == COVER_SIZE)
+    {
+        trace_span ("get_cover", ts);
+        return pb;
+    }
+    w = gdk_pixbuf_get_width (pb);
+    dw = (w > h) ? COVER_SIZE : COVER_SIZE * w / h;
+    dh = (w > h) ? COVER_SIZE * h / w : COVER_SIZE;
+
+    // the box filter only shrinks, and only handles opaque covers
+    if (w >= dw && h >= dh && !gdk_pixbuf_get_has_alpha (pb) && gdk_pixbuf_get_n_channels (pb) == 3
+        && gdk_pixbuf_get_bits_per_sample (pb) == 8)
+        spb = scale_cover (pb, dw, dh);
+    else spb = gdk_pixbuf_scale_simple (pb, dw, dh, GDK_INTERP_BILINEAR);
+    g_object_unref (pb);
+    trace_span ("get_cover", ts);
+    return spb;
+}
+
+/* thumb_path - path of the cached thumbnail for a cover file with a given set of overlays */
+
+static char *thumb_path (const char *lpath, int dl, gboolean new)
+{
+    char *hash, *path;
+
+    hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, lpath, -1);
+    path = g_strdup_printf ("%s%s%s-%d%d.rgba", g_get_home_dir (), THUMB_PATH, hash, dl, !!new);
+    g_free (hash);
+    return path;
+}
+
+/* load_thumb - map a cached thumbnail as a pixbuf, if it was made from the current version of its cover file */
+
+static GdkPixbuf *load_thumb (const char *tpath, gint64 mtime, goffset size)
+{
+    const thumb_header_t *hdr;
+    GMappedFile *map;
+    GBytes *bytes, *pixels;
+    GdkPixbuf *pb = NULL;
+    gsize len, plen;
+
+    map = g_mapped_file_new (tpath, FALSE, NULL);
+    if (!map) return NULL;
+
+    len = g_mapped_file_get_length (map);
+    hdr = (const thumb_header_t *) g_mapped_file_get_contents (map);
+    if (len > sizeof (thumb_header_t) && hdr->magic == THUMB_MAGIC && hdr->version == THUMB_VERSION
+        && hdr->src_mtime == mtime && hdr->src_size == (guint64) size && hdr->width && hdr->height)
+    {
+        plen = len - sizeof (thumb_header_t);
+        if (plen == (gsize) hdr->rowstride * (hdr->height - 1) + hdr->width * (hdr->has_alpha ? 4 : 3))
+        {
+            // the pixbuf keeps the mapping alive for as long as it is in use
+            bytes = g_mapped_file_get_bytes (map);
+            pixels = g_bytes_new_from_bytes (bytes, sizeof (thumb_header_t), plen);
+            pb = gdk_pixbuf_new_from_bytes (pixels, GDK_COLORSPACE_RGB, hdr->has_alpha, 8, hdr->width, hdr->height, hdr->rowstride);
+            g_bytes_unref (pixels);
+            g_bytes_unref (bytes);
+        }
+    }
+    g_mapped_file_unref (map);
+    return pb;
+}
+
+/* save_thumb - write the raw pixels of a finished cover to the thumbnail cache */
+
+static void save_thumb (const char *tpath, GdkPixbuf *pb, gint64 mtime, goffset size)
+{
+    thumb_header_t hdr;
+    char *tmppath;
+    FILE *fp;
+    gsize len;
+    int fd;
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = THUMB_MAGIC;
+    hdr.version = THUMB_VERSION;
+    hdr.width = gdk_pixbuf_get_width (pb);
+    hdr.height = gdk_pixbuf_get_height (pb);
+    hdr.rowstride = gdk_pixbuf_get_rowstride (pb);
+    hdr.has_alpha = gdk_pixbuf_get_has_alpha (pb);
+    hdr.src_size = size;
+    hdr.src_mtime = mtime;
+    len = gdk_pixbuf_get_byte_length (pb);
+
+    tmppath = g_strdup_printf ("%s.XXXXXX", tpath);
+    fd = g_mkstemp (tmppath);
+    fp = fd != -1 ? fdopen (fd, "wb") : NULL;
+    if (fp)
+    {
+        if (fwrite (&hdr, sizeof (hdr), 1, fp) == 1
+            && fwrite (gdk_pixbuf_read_pixels (pb), 1, len, fp) == len
+            && fclose (fp) == 0)
+            rename (tmppath, tpath);
+        else remove (tmppath);
+    }
+    g_free (tmppath);
+}
+
+/* make_cover - get the scaled cover at lpath with the overlays for its state, from the thumbnail cache if possible */
+
+static GdkPixbuf *make_cover (char *lpath, int dl, gboolean new)
+{
+    GdkPixbuf *cover;
+    char *tpath;
+    goffset size;
+    gint64 mtime;
+    int w, h;
+
+    tpath = thumb_path (lpath, dl, new);
+    mtime = file_mtime (lpath, &size);
+    if (mtime != -1) mark_used (lpath);
+    if (mtime != -1 && (cover = load_thumb (tpath, mtime, size)))
+    {
+        mark_used (tpath);
+        g_free (tpath);
+        return cover;
+    }
+
+    cover = get_cover (lpath);
+    w = gdk_pixbuf_get_width (cover);
+    h = gdk_pixbuf_get_height (cover);
+
+    switch (dl)
+    {
+        case FILE_AVAILABLE:
+            if (overlay_cover (cover, &cloud_layer)) break;
+            gdk_pixbuf_composite (grey, cover, 0, 0, w, h, 0, 0, 1, 1, GDK_INTERP_BILINEAR, 128);
+            gdk_pixbuf_composite (cloud, cover, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
+            break;
+
+        case FILE_LOCKED:
+            if (overlay_cover (cover, &padlock_layer)) break;
+            gdk_pixbuf_composite (grey, cover, 0, 0, w, h, 0, 0, 1, 1, GDK_INTERP_BILINEAR, 128);
+            gdk_pixbuf_composite (padlock, cover, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
+            break;
+
+        default : break;
+    }
+    if (new && !blend_layer (cover, &newcorn_layer, w - 32, 0))
+        gdk_pixbuf_composite (newcorn, cover, w - 32, 0, 32, 32, w - 32, 0, 1, 1, GDK_INTERP_BILINEAR, 255);
+
+    if (mtime != -1) save_thumb (tpath, cover, mtime, size);
+    g_free (tpath);
+    return cover;
+}
+
+/* update_cover_entry - queues the cover at lpath to be prepared for the shelf item at index */
+
+static void update_cover_entry (int index, char *lpath, int dl, gboolean new)
+{
+    cover_job_t *job;
+
+    job = g_new0 (cover_job_t, 1);
+    job->index = index;
+    job->gen = store_gen;
+    job->lpath = g_strdup (lpath);
+    job->dl = dl;
+    job->new = new;
+    trace_begin ("update_cover_entry", job, lpath);
+    g_thread_pool_push (cover_pool, job, NULL);
+}
+
+/* cover_worker - thread pool function to decode, scale and overlay a cover */
+
+static void cover_worker (gpointer data, gpointer user_data)
+{
+    cover_job_t *job = data;
+
+    job->cover = make_cover (job->lpath, job->dl, job->new);
+    g_async_queue_push (done_covers, job);
+
+    // one idle callback collects everything which finishes before it runs
+    if (g_atomic_int_compare_and_exchange (&covers_flush, 0, 1)) g_idle_add (flush_covers, NULL);
+}
+
+/* flush_covers - set all the covers finished by the pool on the shelf */
+
+static gboolean flush_covers (gpointer data)
+{
+    cover_job_t *job;
+    gboolean updated = FALSE;
+    item_t *item;
+    gint64 ts = trace_now ();
+
+    g_atomic_int_set (&covers_flush, 0);
+    while ((job = g_async_queue_try_pop (done_covers)))
+    {
+        // a cover started before the shelf was last replaced is still good if its item was kept with the same cover
+        if (job->gen == store_gen - 1 && job->index < cover_remap_len && cover_remap[job->index] != -1)
+        {
+            job->index = cover_remap[job->index];
+            job->gen = store_gen;
+        }
+
+        // drop covers for a replaced shelf, or for a state the item has since left
+        item = job->gen == store_gen ? &g_array_index (shelf->items, item_t, job->index) : NULL;
+        if (item && item->downloaded == job->dl)
+        {
+            g_object_unref (item->cover);
+            item->cover = g_object_ref (job->cover);
+            item_changed (job->index);
+            updated = TRUE;
+        }
+        trace_end ("update_cover_entry", job);
+        g_object_unref (job->cover);
+        g_free (job->lpath);
+        g_free (job);
+    }
+    if (updated) refresh_icons ();
+    resume_covers ();
+    trace_span ("flush_covers", ts);
+    return FALSE;
+}
+
+/* find_cover_for_item - hands covers to the pool, or to the download queue if not cached, in priority order */
+
+static gboolean find_cover_for_item (gpointer data)
+{
+    item_t *item;
+    int n, idx;
+    gchar *clpath, *dir;
+    gint64 ts = trace_now ();
+
+    for (n = 0; n < COVER_BATCH && cover_pos < cover_order->len; cover_pos++)
+    {
+        idx = g_array_index (cover_order, int, cover_pos);
+        if (idx >= shelf->items->len || cover_queued[idx]) continue;
+
+        item = &g_array_index (shelf->items, item_t, idx);
+        clpath = cover_path (item->covpath);
+
+        // only keep a few jobs waiting in each queue, so a reprioritise can still change what comes next; PDFs the user
+        // asked for are queued ahead of covers but do not count, as nothing would restart the walk when they finish
+        if (access (clpath, F_OK) != -1)
+        {
+            if (g_thread_pool_unprocessed (cover_pool) >= 2 * g_thread_pool_get_max_threads (cover_pool)) n = -1;
+            else
+            {
+                // a cached cover is shown straight away, and checked with the server behind it if not for a while;
+                // if the download queue is full, the walk stops here and comes back just to make the check
+                if (idx != cover_unchecked) update_cover_entry (idx, clpath, item->downloaded, FALSE);
+                cover_unchecked = -1;
+                if (cover_stale (clpath) && !transfer_pending (clpath))
+                {
+                    if (queued_background () >= max_transfers)
+                    {
+                        cover_unchecked = idx;
+                        n = -1;
+                    }
+                    else start_curl_download (item->covpath, clpath, cover_refreshed, g_strdup (item->covpath), NULL, NULL, XFER_CONDITIONAL);
+                }
+            }
+        }
+        else if (!transfer_pending (clpath))
+        {
+            if (queued_background () >= max_transfers) n = -1;
+            else
+            {
+                dir = g_path_get_dirname (clpath);
+                g_mkdir_with_parents (dir, 0755);
+                g_free (dir);
+                start_curl_download (item->covpath, clpath, image_download_done, g_strdup (item->covpath), NULL, NULL, XFER_CONDITIONAL);
+            }
+        }
+        g_free (clpath);
+
+        // queues full - wait for flush_covers or image_download_done to resume
+        if (n == -1) break;
+        cover_queued[idx] = TRUE;
+        n++;
+    }
+
+    trace_span ("find_cover_for_item", ts);
+    if (n != -1 && cover_pos < cover_order->len) return TRUE;
+    cover_idle = 0;
+    return FALSE;
+}
+
+/* resume_covers - restart the cover walk if it stopped for full queues */
+
+static void resume_covers (void)
+{
+    if (!cover_idle && cover_order && cover_pos < cover_order->len)
+        cover_idle = g_idle_add (find_cover_for_item, NULL);
+}
+
+/* add_cover_row - append the shelf item at pos in a tab's model to the cover order */
+
+static void add_cover_row (ItemModel *model, int pos)
+{
+    int idx;
+
+    if (pos >= model->rows->len) return;
+    idx = g_array_index (model->rows, guint32, pos);
+    if (!cover_queued[idx]) g_array_append_val (cover_order, idx);
+}
+
+/* prioritise_covers - order remaining covers by distance from what the current tab is showing, then everything else */
+
+static void prioritise_covers (void)
+{
+    GtkTreePath *start, *end;
+    ItemModel *fm;
+    int page, first = 0, last = -1, n, i;
+
+    if (!cover_queued) return;
+    g_array_set_size (cover_order, 0);
+    cover_pos = 0;
+
+    page = gtk_notebook_get_current_page (GTK_NOTEBOOK (items_nb));
+    if (page >= 0 && page < NUM_CATS)
+    {
+        fm = filtered[page];
+        n = fm->rows->len;
+        if (gtk_icon_view_get_visible_range (GTK_ICON_VIEW (item_ivs[page]), &start, &end))
+        {
+            first = gtk_tree_path_get_indices (start)[0];
+            last = gtk_tree_path_get_indices (end)[0];
+            gtk_tree_path_free (start);
+            gtk_tree_path_free (end);
+        }
+
+        // the visible rows, then working outwards from them until the whole tab is covered
+        for (i = first; i <= last; i++) add_cover_row (fm, i);
+        for (i = 1; last + i < n || first - i >= 0; i++)
+        {
+            if (last + i < n) add_cover_row (fm, last + i);
+            if (first - i >= 0) add_cover_row (fm, first - i);
+        }
+    }
+
+    // then the other tabs and anything hidden by the search; rows already listed are skipped by the walk
+    for (i = 0; i < ncovers; i++)
+        if (!cover_queued[i]) g_array_append_val (cover_order, i);
+
+    resume_covers ();
+}
+
+/* reprioritise - idle callback to reorder the cover walk once scrolling or switching tabs has settled */
+
+static gboolean reprioritise (gpointer data)
+{
+    gint64 ts = trace_now ();
+
+    reprio_idle = 0;
+    prioritise_covers ();
+    trace_span ("reprioritise", ts);
+    return FALSE;
+}
+
+static void schedule_reprioritise (void)
+{
+    if (!reprio_idle && cover_queued && cover_pos < cover_order->len)
+        reprio_idle = g_idle_add_full (G_PRIORITY_LOW, reprioritise, NULL, NULL);
+}
+
+/* set_downloaded_cover - prepare a newly downloaded cover for every item using it */
+
+static void set_downloaded_cover (const char *url, gboolean new)
+{
+    item_t *item;
+    gchar *clpath;
+    int i;
+
+    // the shelf may have been reloaded since the download was queued, so set the cover on every item now using it
+    clpath = cover_path (url);
+    for (i = 0; i < shelf->items->len; i++)
+    {
+        item = &g_array_index (shelf->items, item_t, i);
+        if (g_strcmp0 (item->covpath, url)) continue;
+        update_cover_entry (i, clpath, item->downloaded, new);
+    }
+    g_free (clpath);
+}
+
+/* image_download_done - called on completed curl image download; data is the cover URL */
+
+static void image_download_done (tf_status success, gpointer data)
+{
+    if (success == SUCCESS) set_downloaded_cover (data, TRUE);
+    g_free (data);
+    resume_covers ();
+}
+
+/* cover_refreshed - called when a cached cover has been checked with the server; data is the cover URL */
+
+static void cover_refreshed (tf_status success, gpointer data)
+{
+    // only a changed cover needs preparing again, and it is not a new item just because its cover was updated
+    if (success == SUCCESS) set_downloaded_cover (data, FALSE);
+    g_free (data);
+    resume_covers ();
+}
+
+
+/*----------------------------------------------------------------------------*/
+/* PDF handling                                                               */
+/*----------------------------------------------------------------------------*/
 
 /* pdf_selected - called when icon is activated to open or download PDF */
 
-static void pdf_selected (void)
+static void pdf_selected (void)
+{
+    item_t *item;
+    gchar *plpath;
+    guint where;
+
+    // the item may have gone in a catalogue reload since it was clicked
+    if (selitem < 0) return;
+    item = &g_array_index (shelf->items, item_t, selitem);
+    if (item->downloaded == FILE_LOCKED)
+    {
+        message (_("This title is only available to contributors at this time."), TRUE);
+        return;
+    }
+
+    where = file_found (shelf->files, item->pdfpath);
+    if (where & FOUND_SYSTEM)
+    {
+        plpath = get_system_path (item->pdfpath);
+        open_pdf (plpath);
+        g_free (plpath);
+        return;
+    }
+
+    plpath = get_local_path (item->pdfpath, PDF_PATH);
+    if (!(where & FOUND_LOCAL))
+    {
+        // downloads run alongside each other and any browsing, with progress shown on the tile
+        if (!transfer_pending (plpath))
+        {
+            item->progress = 0;
+            item_changed (selitem);
+            start_curl_download (item->pdfpath, plpath, pdf_download_done, g_strdup (item->pdfpath), NULL, item->hash,
+                XFER_RESUMABLE | XFER_ITEM | XFER_SEGMENTED);
+        }
+    }
+    else open_pdf (plpath);
+
+    g_free (plpath);
+}
+
+/* open_pdf - launches default viewer with supplied file */
+
+static void open_pdf (char *path)
+{
+    if (fork () == 0)
+    {
+        execl ("/usr/bin/xdg-open", "xdg-open", path, NULL);
+        exit (0);
+    }
+}
+
+/* pdf_download_done - called on completed curl PDF download; data is the PDF URL */
+
+static void pdf_download_done (tf_status success, gpointer data)
+{
+    gchar *name, *plpath;
+    int idx;
+
+    // the shelf may have been reloaded while downloading, so find the item again; a failure is shown on its tile,
+    // as the modal dialog may be in use by a catalogue load which the download was running alongside
+    if ((idx = find_item (data)) != -1)
+    {
+        g_array_index (shelf->items, item_t, idx).progress = success == FAILURE ? PROGRESS_FAILED : success == NOSPACE ? PROGRESS_NOSPACE : -1;
+        item_changed (idx);
+    }
+
+    if (success == SUCCESS)
+    {
+        // the bookshelf watch will see the file arrive too, but the tile should not have to wait for it
+        name = url_basename (data);
+        file_changed (name, FOUND_LOCAL, TRUE);
+        g_free (name);
+
+        plpath = get_local_path (data, PDF_PATH);
+        open_pdf (plpath);
+        g_free (plpath);
+    }
+    g_free (data);
+}
+
+
+/*----------------------------------------------------------------------------*/
+/* Catalogue management                                                       */
+/*----------------------------------------------------------------------------*/
+
+const char *field_tags[NUM_FIELDS] = { "TITLE", "DESC", "COVER", "PDF", "FILE", "HASH" };
+
+#define N_REMAPS 1
+
+const char *titlemap[N_REMAPS][2] = {
+    {"Raspberry Pi Beginner's Guide 5th edition",   NULL}
+};
+
+/* remap_title - check a book title against the remap table; returns TRUE with the replacement, which may be NULL to drop the item */
+
+static gboolean remap_title (const char *title, size_t len, const char **remapped)
+{
+    int i;
+
+    for (i = 0; i < N_REMAPS; i++)
+    {
+        if (strlen (titlemap[i][0]) == len && !strncmp (title, titlemap[i][0], len))
+        {
+            *remapped = titlemap[i][1];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* download_catalogue - initiate curl download of appropriate catalogue XML file */
+
+static void download_catalogue (void)
+{
+    char *access_key, *path;
+    size_t len;
+    FILE *fp;
+    gint64 ts = trace_now ();
+
+    message (_("Reading list of publications - please wait..."), FALSE);
+
+    access_key = NULL;
+    path = g_build_filename (g_get_home_dir (), CACHE_PATH, "access_key", NULL);
+    fp = fopen (path, "r");
+    if (fp)
+    {
+        if (getline (&access_key, &len, fp) <= 1)
+        {
+            g_free (access_key);
+            access_key = NULL;
+        }
+        fclose (fp);
+    }
+
+    if (access_key)
+        start_curl_download (CONTRIBUTOR_URL, catpath, load_contrib_catalogue, NULL, access_key, NULL, XFER_MODAL | XFER_CONDITIONAL);
+    else
+        start_curl_download (CATALOGUE_URL, catpath, load_catalogue, NULL, NULL, NULL, XFER_MODAL | XFER_CONDITIONAL);
+    g_free (access_key);
+    trace_span ("download_catalogue", ts);
+}
+
+/* load_catalogue - open a catalogue file - either main, backup or fallback */
+
+static void load_catalogue (tf_status success, gpointer data)
+{
+    hide_message ();
+
+    switch (success)
+    {
+        case SUCCESS :  read_data_file (catpath, READ_DOWNLOADED);
+                        break;
+
+        case UNCHANGED :read_data_file (catpath, READ_CACHED);
+                        break;
+
+        case NOSPACE :  message (_("Disk full - unable to download updates"), TRUE);
+                        read_data_file (cbpath, READ_FALLBACK);
+                        break;
+
+        case FAILURE :  message (_("Unable to download updates"), TRUE);
+                        read_data_file (cbpath, READ_FALLBACK);
+                        break;
+
+        default :       break;
+    }
+}
+
+static void load_contrib_catalogue (tf_status success, gpointer data)
+{
+    hide_message ();
+
+    switch (success)
+    {
+        case SUCCESS :  read_data_file (catpath, READ_DOWNLOADED);
+                        break;
+
+        case UNCHANGED :read_data_file (catpath, READ_CACHED);
+                        break;
+
+        case NOSPACE :  message (_("Disk full - unable to download updates"), TRUE);
+                        read_data_file (cbpath, READ_FALLBACK);
+                        break;
+
+        case FAILURE :  message (_("Could not validate your subscription. Try logging in again."), -1);
+                        break;
+
+        default :       break;
+    }
+}
+
+/* partial_file - whether a name in the bookshelf belongs to an unfinished download rather than an item */
+
+static gboolean partial_file (const char *name)
+{
+    return name[0] == '.' || g_str_has_suffix (name, ".curl") || strstr (name, ".journal");
+}
+
+/* scan_dir - add the names of the files in a directory to a set of files, marked with where they were found */
+
+static void scan_dir (GHashTable *files, const char *dir, guint where)
+{
+    struct dirent *dp;
+    struct stat buf;
+    char *path;
+    guint found;
+    DIR *dfd;
+
+    if (!(dfd = opendir (dir))) return;
+    while ((dp = readdir (dfd)))
+    {
+        if (partial_file (dp->d_name)) continue;
+
+        // a link only counts if what it points to is still there
+        if (dp->d_type == DT_LNK || dp->d_type == DT_UNKNOWN)
+        {
+            path = g_build_filename (dir, dp->d_name, NULL);
+            found = stat (path, &buf) != -1;
+            g_free (path);
+            if (!found) continue;
+        }
+
+        found = GPOINTER_TO_UINT (g_hash_table_lookup (files, dp->d_name));
+        g_hash_table_replace (files, g_strdup (dp->d_name), GUINT_TO_POINTER (found | where));
+    }
+    closedir (dfd);
+}
+
+/* scan_files - read the package data dir and the user's bookshelf once, for answering which items are on the system */
+
+static GHashTable *scan_files (void)
+{
+    GHashTable *files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    char *pdpath = g_strdup_printf ("%s%s", g_get_home_dir (), PDF_PATH);
+
+    scan_dir (files, PACKAGE_DATA_DIR, FOUND_SYSTEM);
+    scan_dir (files, pdpath, FOUND_LOCAL);
+    g_free (pdpath);
+    return files;
+}
+
+/* file_found - where the file for a URL was found, or 0 if it is not on the system */
+
+static guint file_found (GHashTable *files, const char *url)
+{
+    char *name;
+    guint where;
+
+    if (!files) return 0;
+    name = url_basename (url);
+    where = GPOINTER_TO_UINT (g_hash_table_lookup (files, name));
+    g_free (name);
+    return where;
+}
+
+/* url_has_name - whether a URL's file is stored under the given name */
+
+static gboolean url_has_name (const char *url, const char *name)
+{
+    const char *base = strrchr (url, '/');
+    size_t len = strlen (name);
+
+    base = base ? base + 1 : url;
+    return !strncmp (base, name, len) && (base[len] == 0 || base[len] == '?');
+}
+
+/* file_changed - record that a file has arrived in or left a location, and update the download state of items using it */
+
+static void file_changed (const char *name, guint where, gboolean found)
+{
+    item_t *item;
+    char *clpath;
+    guint now;
+    int i, dl;
+
+    if (partial_file (name)) return;
+    if (!shelf->files) shelf->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    now = GPOINTER_TO_UINT (g_hash_table_lookup (shelf->files, name));
+    now = found ? now | where : now & ~where;
+    if (now) g_hash_table_replace (shelf->files, g_strdup (name), GUINT_TO_POINTER (now));
+    else g_hash_table_remove (shelf->files, name);
+
+    // only the items whose state has actually changed are touched
+    for (i = 0; i < shelf->items->len; i++)
+    {
+        item = &g_array_index (shelf->items, item_t, i);
+        if (!url_has_name (item->pdfpath, name)) continue;
+
+        dl = now ? FILE_DOWNLOADED : strstr (item->pdfpath, "https://") ? FILE_AVAILABLE : FILE_LOCKED;
+        if (dl == item->downloaded) continue;
+        item->downloaded = dl;
+        item_changed (i);
+
+        clpath = cover_path (item->covpath);
+        update_cover_entry (i, clpath, dl, FALSE);
+        g_free (clpath);
+    }
+}
+
+/* item_status - find whether the file for a catalogue item is already on the system */
+
+static int item_status (GHashTable *files, char *pdfpath, gboolean locked)
+{
+    if (file_found (files, pdfpath)) return FILE_DOWNLOADED;
+    return locked ? FILE_LOCKED : FILE_AVAILABLE;
+}
+
+/* get_lang - language code used to pick translated catalogue entries */
+
+static const char *get_lang (void)
+{
+    static char *lang = NULL;
+    char *contents, **lines, *val = NULL;
+    int i;
+
+    if (lang) return lang;
+
+    // the system locale, as set by raspi-config, read in the same way the shell would
+    if (g_file_get_contents ("/etc/default/locale", &contents, NULL, NULL))
+    {
+        lines = g_strsplit (contents, "\n", -1);
+        for (i = 0; lines[i]; i++)
+        {
+            g_strstrip (lines[i]);
+            if (!strncmp (lines[i], "LANG=", 5)) val = lines[i] + 5;
+        }
+        if (val) lang = g_strdup (val);
+        g_strfreev (lines);
+        g_free (contents);
+    }
+
+    // otherwise whatever the session was started with
+    if (!lang) lang = g_strdup (g_getenv ("LANG") ? g_getenv ("LANG") : "");
+
+    // just the language part of a value like "en_GB.UTF-8", without any quotes
+    g_strdelimit (lang, "\"'", ' ');
+    g_strstrip (lang);
+    lang[strcspn (lang, "_.@")] = 0;
+    return lang;
+}
+
+/* add_item - append an item record to a catalogue; the strings must already be in the catalogue's storage */
+
+static void add_item (catalogue_t *cat, int category, char *title, char *desc, char *pdfpath, char *covpath, char *hash, int downloaded)
+{
+    item_t item = { 0 };
+
+    item.category = category;
+    item.downloaded = downloaded;
+    item.title = title;
+    item.desc = desc;
+    item.pdfpath = pdfpath;
+    item.covpath = covpath;
+    item.hash = hash;
+    g_array_append_val (cat->items, item);
+
+    cat->counts[category]++;
+    if (downloaded == FILE_LOCKED) cat->locked_items = TRUE;
+}
+
+/* new_catalogue - create an empty catalogue */
+
+static catalogue_t *new_catalogue (void)
+{
+    catalogue_t *cat = g_new0 (catalogue_t, 1);
+    int i;
+
+    cat->items = g_array_new (FALSE, FALSE, sizeof (item_t));
+    for (i = 0; i < NUM_CATS; i++) cat->order[i] = g_array_new (FALSE, FALSE, sizeof (guint32));
+    return cat;
+}
+
+/* free_catalogue - release a catalogue and whichever storage holds its strings */
+
+static void free_catalogue (catalogue_t *cat)
+{
+    int i;
+
+    if (!cat) return;
+    for (i = 0; i < cat->items->len; i++)
+        if (g_array_index (cat->items, item_t, i).cover) g_object_unref (g_array_index (cat->items, item_t, i).cover);
+    for (i = 0; i < NUM_CATS; i++) g_array_free (cat->order[i], TRUE);
+    g_array_free (cat->items, TRUE);
+    if (cat->strings) g_string_chunk_free (cat->strings);
+    if (cat->map) g_mapped_file_unref (cat->map);
+    if (cat->files) g_hash_table_unref (cat->files);
+    free_search_index (cat->index);
+    g_free (cat);
+}
+
+/* tag_is - compare a tag name, which is not nul-terminated, with a string */
+
+static gboolean tag_is (const char *tag, size_t len, const char *name)
+{
+    return strlen (name) == len && !memcmp (tag, name, len);
+}
+
+/* field_text - the text to use for a field; a translation wins over the default */
+
+static char *field_text (catalogue_t *cat, span_t *field)
+{
+    span_t *sp = field[1].ptr ? &field[1] : &field[0];
+    return g_string_chunk_insert_len (cat->strings, sp->ptr, sp->len);
+}
+
+/* emit_item - add the item whose fields have just been collected, if it is complete */
+
+static void emit_item (catalogue_t *cat, int category, span_t fields[NUM_FIELDS][2])
+{
+    const char *remapped = NULL;
+    gboolean remap = FALSE, locked;
+    char *title, *path;
+
+    if (category < 0 || !fields[FIELD_TITLE][0].ptr) return;
+    if (category == CAT_BOOKS) remap = remap_title (fields[FIELD_TITLE][0].ptr, fields[FIELD_TITLE][0].len, &remapped);
+    if (remap && !remapped) return;
+    if (!fields[FIELD_DESC][0].ptr || !fields[FIELD_COVER][0].ptr) return;
+    if (!fields[FIELD_PDF][0].ptr && !fields[FIELD_FILE][0].ptr) return;
+
+    if (fields[FIELD_TITLE][1].ptr) title = field_text (cat, fields[FIELD_TITLE]);
+    else
+    {
+        if (remap) title = g_string_chunk_insert (cat->strings, remapped);
+        else title = field_text (cat, fields[FIELD_TITLE]);
+        entitle (title);
+    }
+
+    // items with only a FILE entry are for contributors
+    locked = !fields[FIELD_PDF][0].ptr;
+    path = field_text (cat, locked ? fields[FIELD_FILE] : fields[FIELD_PDF]);
+
+    add_item (cat, category, title, field_text (cat, fields[FIELD_DESC]), path, field_text (cat, fields[FIELD_COVER]),
+        fields[FIELD_HASH][0].ptr ? field_text (cat, fields[FIELD_HASH]) : NULL, item_status (cat->files, path, locked));
+}
+
+/* parse_catalogue - read the catalogue XML at path into item records in a single pass over the mapped file */
+
+static catalogue_t *parse_catalogue (char *path, GHashTable *files)
+{
+    span_t fields[NUM_FIELDS][2];
+    GMappedFile *map;
+    const char *p, *end, *tag, *tend, *attr, *lang;
+    size_t taglen, langlen;
+    int category = -1, f, tr;
+    gboolean in_item = FALSE, closing;
+    catalogue_t *cat;
+
+    map = g_mapped_file_new (path, FALSE, NULL);
+    if (!map) return NULL;
+
+    cat = new_catalogue ();
+    cat->strings = g_string_chunk_new (4096);
+    cat->files = g_hash_table_ref (files);
+    lang = get_lang ();
+    langlen = strlen (lang);
+    memset (fields, 0, sizeof (fields));
+
+    p = g_mapped_file_get_contents (map);
+    end = p + g_mapped_file_get_length (map);
+    while (p < end && (p = memchr (p, '<', end - p)))
+    {
+        tag = p + 1;
+        if (!(tend = memchr (tag, '>', end - tag))) break;
+        p = tend + 1;
+
+        closing = (*tag == '/');
+        if (closing) tag++;
+        for (taglen = 0; tag + taglen < tend && tag[taglen] != ' ' && tag[taglen] != '/'; taglen++);
+
+        if (tag_is (tag, taglen, "ITEM"))
+        {
+            if (closing && in_item) emit_item (cat, category, fields);
+            in_item = !closing;
+            memset (fields, 0, sizeof (fields));
+            continue;
+        }
+
+        if (!in_item)
+        {
+            if (closing) continue;
+            if (tag_is (tag, taglen, "MAGPI")) category = CAT_MAGPI;
+            else if (tag_is (tag, taglen, "BOOKS")) category = CAT_BOOKS;
+            continue;
+        }
+
+        if (closing) continue;
+        for (f = 0; f < NUM_FIELDS; f++)
+            if (tag_is (tag, taglen, field_tags[f])) break;
+        if (f == NUM_FIELDS) continue;
+
+        // an attribute can only be the LANG of a translation, which is only wanted for the current language
+        tr = 0;
+        attr = tag + taglen;
+        if (attr < tend)
+        {
+            if (!langlen || !(attr = memmem (attr, tend - attr, "LANG=\"", 6))) continue;
+            attr += 6;
+            if (tend - attr <= langlen || strncmp (attr, lang, langlen) || attr[langlen] != '"') continue;
+            tr = 1;
+        }
+
+        // the text runs to the next tag, which may be on a later line
+        if (!(tend = memchr (p, '<', end - p))) break;
+        fields[f][tr].ptr = p;
+        fields[f][tr].len = tend - p;
+        p = tend;
+    }
+
+    g_mapped_file_unref (map);
+    return cat;
+}
+
+/* file_digest - SHA-256 of a file's contents */
+
+static gboolean file_digest (char *path, guint8 *digest)
+{
+    GMappedFile *map;
+    GChecksum *cs;
+    gsize len = SNAP_DIGEST_LEN;
+
+    map = g_mapped_file_new (path, FALSE, NULL);
+    if (!map) return FALSE;
+    cs = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (cs, (guchar *) g_mapped_file_get_contents (map), g_mapped_file_get_length (map));
+    g_checksum_get_digest (cs, digest, &len);
+    g_checksum_free (cs);
+    g_mapped_file_unref (map);
+    return TRUE;
+}
+
+/* file_mtime - modification time of a file or directory in nanoseconds, or -1 if it is not there */
+
+static gint64 file_mtime (const char *path, goffset *size)
+{
+    struct stat st;
+
+    if (stat (path, &st) == -1) return -1;
+    if (size) *size = st.st_size;
+    return (gint64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* write_snapshot - save a parsed catalogue in binary form next to the XML it came from */
+
+static void write_snapshot (char *path, catalogue_t *cat)
+{
+    snap_header_t hdr;
+    snap_item_t rec;
+    GByteArray *recs;
+    GString *strtab;
+    char *spath, *tmppath, *pdpath;
+    item_t *item;
+    goffset size;
+    FILE *fp;
+    int i, fd;
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = SNAP_MAGIC;
+    hdr.version = SNAP_VERSION;
+    hdr.count = cat->items->len;
+    hdr.locked = cat->locked_items;
+    hdr.src_mtime = file_mtime (path, &size);
+    hdr.src_size = size;
+    if (hdr.src_mtime == -1 || !file_digest (path, hdr.digest)) return;
+    pdpath = g_strdup_printf ("%s%s", g_get_home_dir (), PDF_PATH);
+    hdr.pdf_mtime = file_mtime (pdpath, NULL);
+    hdr.sys_mtime = file_mtime (PACKAGE_DATA_DIR, NULL);
+    g_free (pdpath);
+    g_strlcpy (hdr.lang, get_lang (), sizeof (hdr.lang));
+
+    // item records hold offsets into a table of nul-terminated strings which follows them
+    recs = g_byte_array_sized_new (cat->items->len * sizeof (snap_item_t));
+    strtab = g_string_sized_new (cat->items->len * 256);
+    for (i = 0; i < cat->items->len; i++)
+    {
+        item = &g_array_index (cat->items, item_t, i);
+        rec.category = item->category;
+        rec.downloaded = item->downloaded;
+        rec.title = strtab->len;
+        g_string_append_len (strtab, item->title, strlen (item->title) + 1);
+        rec.desc = strtab->len;
+        g_string_append_len (strtab, item->desc, strlen (item->desc) + 1);
+        rec.pdfpath = strtab->len;
+        g_string_append_len (strtab, item->pdfpath, strlen (item->pdfpath) + 1);
+        rec.covpath = strtab->len;
+        g_string_append_len (strtab, item->covpath, strlen (item->covpath) + 1);
+        rec.hash = strtab->len;
+        g_string_append_len (strtab, item->hash ? item->hash : "", item->hash ? strlen (item->hash) + 1 : 1);
+        g_byte_array_append (recs, (guint8 *) &rec, sizeof (rec));
+    }
+    hdr.strtab_len = strtab->len;
+
+    // write to a temporary file and rename, so a reader never maps a half-written snapshot
+    spath = g_strdup_printf ("%s.snap", path);
+    tmppath = g_strdup_printf ("%s.XXXXXX", spath);
+    fd = g_mkstemp (tmppath);
+    fp = fd != -1 ? fdopen (fd, "wb") : NULL;
+    if (fp)
+    {
+        if (fwrite (&hdr, sizeof (hdr), 1, fp) == 1
+            && fwrite (recs->data, 1, recs->len, fp) == recs->len
+            && fwrite (strtab->str, 1, strtab->len, fp) == strtab->len
+            && fclose (fp) == 0)
+            rename (tmppath, spath);
+        else remove (tmppath);
+    }
+
+    g_free (tmppath);
+    g_free (spath);
+    g_string_free (strtab, TRUE);
+    g_byte_array_free (recs, TRUE);
+}
+
+/* load_snapshot - map the binary snapshot for the XML at path, if there is one which matches it */
+
+static catalogue_t *load_snapshot (char *path, GHashTable *files)
 {
-    gchar *ppath, *plpath;
-    int dl;
+    const snap_header_t *hdr;
+    const snap_item_t *rec;
+    guint8 digest[SNAP_DIGEST_LEN];
+    GMappedFile *map;
+    const char *data, *strtab;
+    char *spath, *pdpath;
+    catalogue_t *cat;
+    gboolean reprobe, rewrite = FALSE;
+    goffset size;
+    gint64 mtime;
+    gsize len;
+    item_t item = { 0 };
+    int i;
 
-    gtk_tree_model_get (GTK_TREE_MODEL (items), &selitem, ITEM_PDFPATH, &ppath, ITEM_DOWNLOADED, &dl, -1);
+    spath = g_strdup_printf ("%s.snap", path);
+    map = g_mapped_file_new (spath, FALSE, NULL);
+    g_free (spath);
+    if (!map) return NULL;
+
+    data = g_mapped_file_get_contents (map);
+    len = g_mapped_file_get_length (map);
+    hdr = (const snap_header_t *) data;
+    if (len < sizeof (snap_header_t) || hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION
+        || len != sizeof (snap_header_t) + (gsize) hdr->count * sizeof (snap_item_t) + hdr->strtab_len
+        || strncmp (hdr->lang, get_lang (), sizeof (hdr->lang)))
+    {
+        g_mapped_file_unref (map);
+        return NULL;
+    }
 
-    if (dl == FILE_LOCKED)
+    // a changed size or timestamp does not mean changed bytes - the backup copy gets a new timestamp, for instance
+    mtime = file_mtime (path, &size);
+    if (mtime == -1)
     {
-        message (_("This title is only available to contributors at this time."), TRUE);
-        g_free (ppath);
+        g_mapped_file_unref (map);
+        return NULL;
+    }
+    if (mtime != hdr->src_mtime || size != (goffset) hdr->src_size)
+    {
+        if (size != (goffset) hdr->src_size || !file_digest (path, digest) || memcmp (digest, hdr->digest, SNAP_DIGEST_LEN))
+        {
+            g_mapped_file_unref (map);
+            return NULL;
+        }
+        rewrite = TRUE;
+    }
+
+    // the stored download states are only good if nothing has been added to or removed from the PDF directories since
+    pdpath = g_strdup_printf ("%s%s", g_get_home_dir (), PDF_PATH);
+    reprobe = file_mtime (pdpath, NULL) != hdr->pdf_mtime || file_mtime (PACKAGE_DATA_DIR, NULL) != hdr->sys_mtime;
+    g_free (pdpath);
+
+    cat = new_catalogue ();
+    cat->map = map;
+    cat->files = g_hash_table_ref (files);
+    rec = (const snap_item_t *) (data + sizeof (snap_header_t));
+    strtab = (const char *) (rec + hdr->count);
+    for (i = 0; i < hdr->count; i++, rec++)
+    {
+        if (rec->category >= NUM_CATS || rec->title >= hdr->strtab_len || rec->desc >= hdr->strtab_len
+            || rec->pdfpath >= hdr->strtab_len || rec->covpath >= hdr->strtab_len || rec->hash >= hdr->strtab_len)
+        {
+            free_catalogue (cat);
+            return NULL;
+        }
+        item.category = rec->category;
+        item.title = (char *) strtab + rec->title;
+        item.desc = (char *) strtab + rec->desc;
+        item.pdfpath = (char *) strtab + rec->pdfpath;
+        item.covpath = (char *) strtab + rec->covpath;
+        item.hash = strtab[rec->hash] ? (char *) strtab + rec->hash : NULL;
+        item.downloaded = rec->downloaded;
+        if (reprobe) item.downloaded = item_status (files, item.pdfpath, !strstr (item.pdfpath, "https://"));
+        g_array_append_val (cat->items, item);
+
+        cat->counts[item.category]++;
+        if (item.downloaded == FILE_LOCKED) cat->locked_items = TRUE;
+    }
+    if (hdr->strtab_len && strtab[hdr->strtab_len - 1] != 0)
+    {
+        free_catalogue (cat);
+        return NULL;
+    }
+
+    if (reprobe || rewrite) write_snapshot (path, cat);
+    return cat;
+}
+
+/* compare_items - sort function for a category's title order; magazines newest first, books alphabetically */
+
+static gint compare_items (gconstpointer a, gconstpointer b, gpointer data)
+{
+    GArray *items = data;
+    item_t *ia = &g_array_index (items, item_t, *(const guint32 *) a);
+    item_t *ib = &g_array_index (items, item_t, *(const guint32 *) b);
+    int issuea, issueb;
+
+    if (ia->category == CAT_MAGPI)
+    {
+        issuea = issueb = 0;
+        sscanf (ia->title, "Issue %d", &issuea);
+        sscanf (ib->title, "Issue %d", &issueb);
+        return issueb - issuea;
+    }
+    return strcasecmp (ia->title, ib->title);
+}
+
+/* sort_catalogue - list each category's items in title order, and note each item's place in it */
+
+static void sort_catalogue (catalogue_t *cat)
+{
+    guint32 i;
+    int c;
+
+    for (i = 0; i < cat->items->len; i++)
+        g_array_append_val (cat->order[g_array_index (cat->items, item_t, i).category], i);
+    for (c = 0; c < NUM_CATS; c++)
+    {
+        g_array_sort_with_data (cat->order[c], compare_items, cat->items);
+        for (i = 0; i < cat->order[c]->len; i++)
+            g_array_index (cat->items, item_t, g_array_index (cat->order[c], guint32, i)).rank = i;
+    }
+}
+
+/* attach_shelf - make a catalogue the shelf, giving each icon view a model over its items which pass the search */
+
+static void attach_shelf (catalogue_t *cat)
+{
+    catalogue_t *old = shelf;
+    int i;
+
+    shelf = cat;
+    for (i = 0; i < NUM_CATS; i++)
+    {
+        search_stale[i] = FALSE;
+        if (filtered[i]) g_object_unref (filtered[i]);
+        filtered[i] = item_model_new (cat, i, filter_rows (cat, i));
+        gtk_icon_view_set_model (GTK_ICON_VIEW (item_ivs[i]), GTK_TREE_MODEL (filtered[i]));
+    }
+
+    // only freed once the views have stopped showing it
+    if (old && old != cat) free_catalogue (old);
+    store_gen++;
+}
+
+/* item_key - identifies an item across catalogue reloads - its category and the name its file is stored under */
+
+static char *item_key (item_t *item)
+{
+    char *name = url_basename (item->pdfpath), *key;
+
+    key = g_strdup_printf ("%d/%s", item->category, name);
+    g_free (name);
+    return key;
+}
+
+/* default_cover - the cover shown for an item until its own has been prepared */
+
+static GdkPixbuf *default_cover (int dl)
+{
+    return dl ? (dl == FILE_LOCKED ? nolock : nocover) : nodl;
+}
+
+/* update_tab - move a tab's model from the old shelf to the new one, signalling only the rows which differ;
+ * moved maps each old item to the new item with the same key, or -1 */
+
+static void update_tab (int category, catalogue_t *old, const int *moved)
+{
+    ItemModel *model = filtered[category];
+    GArray *changed, *rows = filter_rows (shelf, category);
+    item_t *prev, *item;
+    GtkTreePath *path;
+    guint8 *keep;
+    gint64 last = -1;
+    guint pos, kept = 0;
+    int n;
+
+    // a row stays if its item is still shown under the same title and in the same order; anything else is removed and added again
+    keep = g_new0 (guint8, model->rows->len + 1);
+    changed = g_array_new (FALSE, FALSE, sizeof (int));
+    for (pos = 0; pos < model->rows->len; pos++)
+    {
+        prev = &g_array_index (old->items, item_t, g_array_index (model->rows, guint32, pos));
+        n = moved[g_array_index (model->rows, guint32, pos)];
+        if (n == -1) continue;
+        item = &g_array_index (shelf->items, item_t, n);
+        if (item->category != category || !(search_all || search_match[n]) || strcmp (item->title, prev->title)
+            || (gint64) item->rank <= last) continue;
+
+        last = item->rank;
+        keep[pos] = TRUE;
+        kept++;
+        if (strcmp (item->desc, prev->desc) || item->downloaded != prev->downloaded || item->cover != prev->cover
+            || item->progress != prev->progress)
+            g_array_append_val (changed, n);
+    }
+
+    if (model->rows->len - kept > BULK_ROWS)
+    {
+        // too much has gone to remove it row by row, so the view is given the new rows all at once
+        g_object_ref (model);
+        gtk_icon_view_set_model (GTK_ICON_VIEW (item_ivs[category]), NULL);
+        g_array_free (model->rows, TRUE);
+        model->rows = rows;
+        model->cat = shelf;
+        model->stamp++;
+        gtk_icon_view_set_model (GTK_ICON_VIEW (item_ivs[category]), GTK_TREE_MODEL (model));
+        g_object_unref (model);
+    }
+    else
+    {
+        // removed from the end first, so the positions of the rows still to go do not move
+        for (pos = model->rows->len; pos-- > 0;)
+        {
+            if (keep[pos]) continue;
+            g_array_remove_index (model->rows, pos);
+            model->stamp++;
+            path = gtk_tree_path_new_from_indices (pos, -1);
+            gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+            gtk_tree_path_free (path);
+        }
+
+        // what is left is the same items in the same order, so the model can move to the new shelf without the view seeing it
+        for (pos = 0; pos < model->rows->len; pos++)
+            g_array_index (model->rows, guint32, pos) = moved[g_array_index (model->rows, guint32, pos)];
+        model->cat = shelf;
+        model->stamp++;
+
+        set_rows (category, rows);
+        for (pos = 0; pos < changed->len; pos++) item_changed (g_array_index (changed, int, pos));
+    }
+    search_stale[category] = FALSE;
+    g_array_free (changed, TRUE);
+    g_free (keep);
+}
+
+/* fill_store - replace the shelf with a catalogue, keeping the rows and covers of items which are in both */
+
+static int fill_store (catalogue_t *cat)
+{
+    catalogue_t *old = shelf;
+    GHashTable *keys;
+    transfer_t *xfer;
+    item_t *item, *prev;
+    guint8 *queued;
+    int *moved;
+    char *key;
+    int i, o, count = 0;
+
+    // the cover walk works through items of the old shelf, so stop it before replacing
+    if (cover_idle)
+    {
+        g_source_remove (cover_idle);
+        cover_idle = 0;
+    }
+
+    // match each new item with the old item of the same key; duplicate keys go to the first
+    keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (o = 0; o < old->items->len; o++)
+    {
+        key = item_key (&g_array_index (old->items, item_t, o));
+        if (!g_hash_table_contains (keys, key)) g_hash_table_insert (keys, key, GINT_TO_POINTER (o + 1));
+        else g_free (key);
+    }
+    moved = g_new (int, old->items->len + 1);
+    g_free (cover_remap);
+    cover_remap = g_new (int, old->items->len + 1);
+    cover_remap_len = old->items->len;
+    for (o = 0; o < old->items->len; o++) moved[o] = cover_remap[o] = -1;
+
+    queued = g_new0 (guint8, cat->items->len + 1);
+    for (i = 0; i < cat->items->len; i++)
+    {
+        item = &g_array_index (cat->items, item_t, i);
+        item->progress = (xfer = item_transfer (item->pdfpath)) ? xfer->percent : -1;
+        count++;
+
+        key = item_key (item);
+        o = GPOINTER_TO_INT (g_hash_table_lookup (keys, key)) - 1;
+        g_free (key);
+        if (o == -1 || moved[o] != -1)
+        {
+            item->cover = g_object_ref (default_cover (item->downloaded));
+            continue;
+        }
+        moved[o] = i;
+
+        // the cover already shown is kept; it only needs preparing again if the download state it shows has changed
+        prev = &g_array_index (old->items, item_t, o);
+        if (strcmp (prev->covpath, item->covpath))
+        {
+            item->cover = g_object_ref (default_cover (item->downloaded));
+            continue;
+        }
+        item->cover = g_object_ref (prev->cover);
+        cover_remap[o] = i;
+        queued[i] = o < ncovers && cover_queued[o] && prev->downloaded == item->downloaded
+            && prev->cover != default_cover (prev->downloaded);
+    }
+    g_hash_table_destroy (keys);
+
+    // the tabs are brought up to date with the current search on the new shelf
+    free_search_index (search_idx);
+    search_idx = cat->index;
+    cat->index = NULL;
+    run_search ();
+    shelf = cat;
+    for (i = 0; i < NUM_CATS; i++) update_tab (i, old, moved);
+    if (selitem >= 0 && selitem < old->items->len) selitem = moved[selitem];
+    free_catalogue (old);
+    g_free (moved);
+    store_gen++;
+
+    gtk_widget_set_visible (contrib_btn, cat->locked_items);
+
+    // hide any tab with no entries
+    for (i = 0; i < NUM_CATS; i++)
+    {
+        gtk_widget_set_visible (gtk_notebook_get_nth_page (GTK_NOTEBOOK (items_nb), i), !!cat->counts[i]);
+    }
+    g_free (cover_queued);
+    cover_queued = queued;
+    cover_unchecked = -1;
+    ncovers = count;
+    if (!count) return count;
+
+    if (!first_grid)
+    {
+        first_grid = g_get_monotonic_time ();
+        g_debug ("first grid populated %" G_GINT64_FORMAT " ms after start", (first_grid - start_time) / 1000);
+    }
+
+    // carry on loading covers, nearest to the top of the current tab first
+    prioritise_covers ();
+    return count;
+}
+
+/* backup_catalogue - keep a copy of a catalogue which loaded successfully */
+
+static void backup_catalogue (void)
+{
+    if (!copy_file (catpath, cbpath)) g_debug ("Unable to back up catalogue");
+}
+
+/* read_catalogue - load a catalogue from its snapshot, or parse it and write a new snapshot if that is out of date */
+
+static catalogue_t *read_catalogue (char *path, read_mode mode, GHashTable *files)
+{
+    catalogue_t *cat;
+    gint64 ts = trace_now ();
+
+    cat = load_snapshot (path, files);
+    trace_span ("load_snapshot", ts);
+
+    // at startup, only a snapshot is quick enough to be worth showing before the download
+    if (!cat && mode != READ_PRELOAD)
+    {
+        ts = trace_now ();
+        cat = parse_catalogue (path, files);
+        if (cat && cat->items->len) write_snapshot (path, cat);
+        trace_span ("parse_catalogue", ts);
+    }
+    return cat;
+}
+
+/* read_data_thread - worker thread to load a catalogue from its snapshot, or parse it if that is out of date */
+
+static void read_data_thread (GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+    read_req_t *req = data;
+    catalogue_t *cat;
+    GHashTable *files;
+    gint64 ts = trace_now ();
+
+    // one pass over the directories answers every item's download state, and stays with the catalogue for later checks
+    files = scan_files ();
+    cat = read_catalogue (req->path, req->mode, files);
+    g_hash_table_unref (files);
+    if (cat)
+    {
+        sort_catalogue (cat);
+        cat->index = build_search_index (cat);
+    }
+    trace_span ("read_data_thread", ts);
+    g_task_return_pointer (task, cat, (GDestroyNotify) free_catalogue);
+}
+
+/* data_file_read - called on the main thread with the worker's catalogue */
+
+static void data_file_read (GObject *source, GAsyncResult *res, gpointer data)
+{
+    read_req_t *req = g_task_get_task_data (G_TASK (res));
+    catalogue_t *cat;
+    int count = 0;
+
+    cat = g_task_propagate_pointer (G_TASK (res), NULL);
+    trace_end ("read_data_file", req);
+
+    // a later load has been started since this one, so its result is what should be shown
+    if (req->gen != read_gen)
+    {
+        free_catalogue (cat);
         return;
     }
 
-    plpath = get_system_path (ppath);
-    if (access (plpath, F_OK) != -1)
+    if (cat && (cat->items->len || req->mode != READ_PRELOAD)) count = fill_store (cat);
+    else free_catalogue (cat);
+
+    switch (req->mode)
     {
-        open_pdf (plpath);
-        g_free (plpath);
-        g_free (ppath);
+        case READ_DOWNLOADED :  if (count)
+                                {
+                                    backup_catalogue ();
+                                    break;
+                                }
+                                message (_("Downloaded catalogue not valid"), TRUE);
+                                read_data_file (cbpath, READ_FALLBACK);
+                                break;
+
+        case READ_CACHED :      if (count) break;
+                                // the cached copy is unusable, so make sure it is fetched in full next time
+                                discard_validators (catpath);
+                                message (_("Downloaded catalogue not valid"), TRUE);
+                                read_data_file (cbpath, READ_FALLBACK);
+                                break;
+
+        default :               break;
+    }
+}
+
+static void free_read_req (read_req_t *req)
+{
+    g_free (req->path);
+    g_free (req);
+}
+
+/* read_data_file - load the catalogue at path onto the shelf, parsing it on a worker thread */
+
+static void read_data_file (char *path, read_mode mode)
+{
+    read_req_t *req;
+    GTask *task;
+
+    // looked up here, as the worker must not be the first to call it
+    get_lang ();
+
+    req = g_new0 (read_req_t, 1);
+    req->path = g_strdup (path);
+    req->mode = mode;
+    req->gen = ++read_gen;
+    trace_begin ("read_data_file", req, path);
+
+    task = g_task_new (NULL, NULL, data_file_read, NULL);
+    g_task_set_task_data (task, req, (GDestroyNotify) free_read_req);
+    g_task_run_in_thread (task, read_data_thread);
+    g_object_unref (task);
+}
+
+/* symlink_user_guide - check and create / delete symlinks to files in /usr/share/userguide, if either directory has changed since last time */
+
+static void symlink_user_guide (void)
+{
+    struct dirent *dp;
+    struct stat buf;
+    GKeyFile *kf;
+    DIR *dfd;
+    char *pdpath, *spath, *dpath, *state;
+    gint64 pdf_mtime, guide_mtime;
+
+    // while the program runs the watches keep the links in step, so only changes made since it last ran need a rescan
+    pdpath = g_strdup_printf ("%s%s", g_get_home_dir (), PDF_PATH);
+    state = g_strdup_printf ("%s%s", g_get_home_dir (), GUIDE_STATE);
+    kf = g_key_file_new ();
+    if (g_key_file_load_from_file (kf, state, G_KEY_FILE_NONE, NULL)
+        && g_key_file_get_int64 (kf, "UserGuide", "BookshelfMtime", NULL) == file_mtime (pdpath, NULL)
+        && g_key_file_get_int64 (kf, "UserGuide", "GuideMtime", NULL) == file_mtime (GUIDE_PATH, NULL))
+    {
+        g_key_file_free (kf);
+        g_free (state);
+        g_free (pdpath);
         return;
     }
-    g_free (plpath);
 
-    plpath = get_local_path (ppath, PDF_PATH);
-    if (access (plpath, F_OK) == -1)
+    // loop through all files in PDF dir looking for old symlinks
+    if ((dfd = opendir (pdpath)))
     {
-        message (_("Downloading - please wait..."), FALSE);
-        if (!cover_dl) start_curl_download (ppath, plpath, pdf_download_done, NULL);
-        else pdf_dl_req = TRUE;
+        while ((dp = readdir (dfd)))
+        {
+            spath = g_strdup_printf ("%s%s", GUIDE_PATH, dp->d_name);
+            dpath = g_strdup_printf ("%s%s", pdpath, dp->d_name);
+            if (lstat (dpath, &buf) != -1 && S_ISLNK (buf.st_mode))
+            {
+                // file is a symlink - if there is no corresponding file, delete the link
+                if (stat (spath, &buf) == -1) unlink (dpath);
+            }
+            g_free (spath);
+            g_free (dpath);
+        }
+        closedir (dfd);
     }
-    else open_pdf (plpath);
 
-    g_free (plpath);
-    g_free (ppath);
+    // loop through all files in userguide dir creating new symlinks
+    if ((dfd = opendir (GUIDE_PATH)))
+    {
+        while ((dp = readdir (dfd)))
+        {
+            if (dp->d_name[0] == '.') continue;
+
+            spath = g_strdup_printf ("%s%s", GUIDE_PATH, dp->d_name);
+            dpath = g_strdup_printf ("%s%s", pdpath, dp->d_name);
+
+            // if file is not already present in dest, create a symlink to it
+            if (stat (dpath, &buf) == -1) symlink (spath, dpath);
+
+            g_free (spath);
+            g_free (dpath);
+        }
+        closedir (dfd);
+    }
+
+    // recorded after the links are made, as making them changes the bookshelf
+    pdf_mtime = file_mtime (pdpath, NULL);
+    guide_mtime = file_mtime (GUIDE_PATH, NULL);
+    g_key_file_set_int64 (kf, "UserGuide", "BookshelfMtime", pdf_mtime);
+    g_key_file_set_int64 (kf, "UserGuide", "GuideMtime", guide_mtime);
+    g_key_file_save_to_file (kf, state, NULL);
+    g_key_file_free (kf);
+    g_free (state);
+    g_free (pdpath);
 }
 
-/* open_pdf - launches default viewer with supplied file */
+/* sync_guide_file - link a user guide file into the bookshelf, or remove the link if the file has gone */
 
-static void open_pdf (char *path)
+static void sync_guide_file (const char *name)
 {
-    if (fork () == 0)
+    struct stat buf;
+    char *spath, *dpath;
+
+    if (name[0] == '.') return;
+    spath = g_strdup_printf ("%s%s", GUIDE_PATH, name);
+    dpath = g_strdup_printf ("%s%s%s", g_get_home_dir (), PDF_PATH, name);
+    if (stat (spath, &buf) != -1)
     {
-        execl ("/usr/bin/xdg-open", "xdg-open", path, NULL);
-        exit (0);
+        if (lstat (dpath, &buf) == -1) symlink (spath, dpath);
+    }
+    else if (lstat (dpath, &buf) != -1 && S_ISLNK (buf.st_mode)) unlink (dpath);
+    g_free (spath);
+    g_free (dpath);
+}
+
+/* bookshelf_changed - handler for the bookshelf watch; updates the items whose files have come or gone */
+
+static void bookshelf_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, gpointer data)
+{
+    char *name = g_file_get_basename (file);
+
+    switch (event)
+    {
+        case G_FILE_MONITOR_EVENT_CREATED :
+        case G_FILE_MONITOR_EVENT_MOVED_IN :    file_changed (name, FOUND_LOCAL, g_file_query_exists (file, NULL));
+                                                break;
+
+        case G_FILE_MONITOR_EVENT_DELETED :
+        case G_FILE_MONITOR_EVENT_MOVED_OUT :   file_changed (name, FOUND_LOCAL, FALSE);
+                                                break;
+
+        // a finished download is renamed from its partial file, which is ignored as the old name
+        case G_FILE_MONITOR_EVENT_RENAMED :     file_changed (name, FOUND_LOCAL, FALSE);
+                                                g_free (name);
+                                                name = g_file_get_basename (other);
+                                                file_changed (name, FOUND_LOCAL, g_file_query_exists (other, NULL));
+                                                break;
+
+        default :                               break;
+    }
+    g_free (name);
+}
+
+/* guide_changed - handler for the user guide watch; the bookshelf watch then sees the links change */
+
+static void guide_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, gpointer data)
+{
+    char *name;
+
+    switch (event)
+    {
+        case G_FILE_MONITOR_EVENT_RENAMED :     name = g_file_get_basename (other);
+                                                sync_guide_file (name);
+                                                g_free (name);
+                                                // fall through
+
+        case G_FILE_MONITOR_EVENT_CREATED :
+        case G_FILE_MONITOR_EVENT_MOVED_IN :
+        case G_FILE_MONITOR_EVENT_DELETED :
+        case G_FILE_MONITOR_EVENT_MOVED_OUT :   name = g_file_get_basename (file);
+                                                sync_guide_file (name);
+                                                g_free (name);
+                                                break;
+
+        default :                               break;
+    }
+}
+
+/* watch_dirs - start watching the bookshelf and the user guide for files coming and going */
+
+static void watch_dirs (void)
+{
+    GFile *dir;
+    char *pdpath;
+
+    pdpath = g_strdup_printf ("%s%s", g_get_home_dir (), PDF_PATH);
+    dir = g_file_new_for_path (pdpath);
+    pdf_monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+    if (pdf_monitor) g_signal_connect (pdf_monitor, "changed", G_CALLBACK (bookshelf_changed), NULL);
+    g_object_unref (dir);
+    g_free (pdpath);
+
+    dir = g_file_new_for_path (GUIDE_PATH);
+    guide_monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+    if (guide_monitor) g_signal_connect (guide_monitor, "changed", G_CALLBACK (guide_changed), NULL);
+    g_object_unref (dir);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Item model                                                                 */
+/*----------------------------------------------------------------------------*/
+
+G_DEFINE_TYPE_WITH_CODE (ItemModel, item_model, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL, item_model_tree_model_init))
+
+static void item_model_init (ItemModel *model)
+{
+    model->rows = g_array_new (FALSE, FALSE, sizeof (guint32));
+    model->stamp = g_random_int ();
+}
+
+static void item_model_class_init (ItemModelClass *klass)
+{
+    G_OBJECT_CLASS (klass)->finalize = item_model_finalize;
+}
+
+static void item_model_finalize (GObject *obj)
+{
+    g_array_free (ITEM_MODEL (obj)->rows, TRUE);
+    G_OBJECT_CLASS (item_model_parent_class)->finalize (obj);
+}
+
+static void item_model_tree_model_init (GtkTreeModelIface *iface)
+{
+    iface->get_flags = item_model_get_flags;
+    iface->get_n_columns = item_model_get_n_columns;
+    iface->get_column_type = item_model_get_column_type;
+    iface->get_iter = item_model_get_iter;
+    iface->get_path = item_model_get_path;
+    iface->get_value = item_model_get_value;
+    iface->iter_next = item_model_iter_next;
+    iface->iter_previous = item_model_iter_previous;
+    iface->iter_children = item_model_iter_children;
+    iface->iter_has_child = item_model_iter_has_child;
+    iface->iter_n_children = item_model_iter_n_children;
+    iface->iter_nth_child = item_model_iter_nth_child;
+    iface->iter_parent = item_model_iter_parent;
+}
+
+static GtkTreeModelFlags item_model_get_flags (GtkTreeModel *model)
+{
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint item_model_get_n_columns (GtkTreeModel *model)
+{
+    return NUM_ITEM_COLS;
+}
+
+static GType item_model_get_column_type (GtkTreeModel *model, gint column)
+{
+    switch (column)
+    {
+        case ITEM_TITLE :
+        case ITEM_DESC :
+        case ITEM_PDFPATH :
+        case ITEM_COVPATH :
+        case ITEM_HASH :        return G_TYPE_STRING;
+        case ITEM_COVER :       return GDK_TYPE_PIXBUF;
+        default :               return G_TYPE_INT;
     }
 }
 
-/* pdf_download_done - called on completed curl PDF download */
+/* item_model_set_iter - point an iterator at a row; it holds the row's position and the shelf index of its item */
+
+static void item_model_set_iter (ItemModel *model, GtkTreeIter *iter, guint pos)
+{
+    iter->stamp = model->stamp;
+    iter->user_data = GUINT_TO_POINTER (g_array_index (model->rows, guint32, pos));
+    iter->user_data2 = GUINT_TO_POINTER (pos);
+}
+
+static gboolean item_model_get_iter (GtkTreeModel *model, GtkTreeIter *iter, GtkTreePath *path)
+{
+    return item_model_iter_nth_child (model, iter, NULL, gtk_tree_path_get_indices (path)[0]);
+}
+
+static GtkTreePath *item_model_get_path (GtkTreeModel *model, GtkTreeIter *iter)
+{
+    return gtk_tree_path_new_from_indices (GPOINTER_TO_UINT (iter->user_data2), -1);
+}
 
-static void pdf_download_done (tf_status success)
+static void item_model_get_value (GtkTreeModel *model, GtkTreeIter *iter, gint column, GValue *value)
 {
-    gchar *cpath, *ppath, *clpath, *plpath;
+    item_t *item = &g_array_index (ITEM_MODEL (model)->cat->items, item_t, GPOINTER_TO_UINT (iter->user_data));
 
-    hide_message ();
-    if (success == SUCCESS)
+    // the strings belong to the catalogue, which outlives anything reading them through the model
+    g_value_init (value, item_model_get_column_type (model, column));
+    switch (column)
     {
-        gtk_tree_model_get (GTK_TREE_MODEL (items), &selitem, ITEM_COVPATH, &cpath, ITEM_PDFPATH, &ppath, -1);
-        plpath = get_local_path (ppath, PDF_PATH);
-        clpath = get_local_path (cpath, CACHE_PATH);
-        open_pdf (plpath);
-
-        GdkPixbuf *cover = get_cover (clpath);
-        gtk_list_store_set (items, &selitem, ITEM_COVER, cover, ITEM_DOWNLOADED, FILE_DOWNLOADED, -1);
-        refresh_icons ();
-
-        g_free (plpath);
-        g_free (clpath);
-        g_free (ppath);
-        g_free (cpath);
-        g_object_unref (cover);
+        case ITEM_CATEGORY :    g_value_set_int (value, item->category);
+                                break;
+        case ITEM_TITLE :       g_value_set_static_string (value, item->title);
+                                break;
+        case ITEM_DESC :        g_value_set_static_string (value, item->desc);
+                                break;
+        case ITEM_PDFPATH :     g_value_set_static_string (value, item->pdfpath);
+                                break;
+        case ITEM_COVPATH :     g_value_set_static_string (value, item->covpath);
+                                break;
+        case ITEM_DOWNLOADED :  g_value_set_int (value, item->downloaded);
+                                break;
+        case ITEM_COVER :       g_value_set_object (value, item->cover);
+                                break;
+        case ITEM_INDEX :       g_value_set_int (value, GPOINTER_TO_UINT (iter->user_data));
+                                break;
+        case ITEM_PROGRESS :    g_value_set_int (value, item->progress);
+                                break;
+        case ITEM_HASH :        g_value_set_static_string (value, item->hash);
+                                break;
     }
-    else if (success == FAILURE) message (_("Unable to download file"), TRUE);
-    else if (success == NOSPACE) message (_("Disk full - unable to download file"), TRUE);
+}
 
-    if (cover_dl) g_idle_add (find_cover_for_item, NULL);
+static gboolean item_model_iter_next (GtkTreeModel *model, GtkTreeIter *iter)
+{
+    return item_model_iter_nth_child (model, iter, NULL, GPOINTER_TO_UINT (iter->user_data2) + 1);
 }
 
-/* get_pending_pdf - start a PDF download that interrupts artwork fetch */
+static gboolean item_model_iter_previous (GtkTreeModel *model, GtkTreeIter *iter)
+{
+    return item_model_iter_nth_child (model, iter, NULL, (gint) GPOINTER_TO_UINT (iter->user_data2) - 1);
+}
 
-static void get_pending_pdf (void)
+static gboolean item_model_iter_children (GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *parent)
 {
-    gchar *ppath, *plpath;
+    return item_model_iter_nth_child (model, iter, parent, 0);
+}
 
-    pdf_dl_req = FALSE;
+static gboolean item_model_iter_has_child (GtkTreeModel *model, GtkTreeIter *iter)
+{
+    return FALSE;
+}
 
-    gtk_tree_model_get (GTK_TREE_MODEL (items), &selitem, ITEM_PDFPATH, &ppath, -1);
+static gint item_model_iter_n_children (GtkTreeModel *model, GtkTreeIter *iter)
+{
+    return iter ? 0 : ITEM_MODEL (model)->rows->len;
+}
 
-    plpath = get_local_path (ppath, PDF_PATH);
-    start_curl_download (ppath, plpath, pdf_download_done, NULL);
+static gboolean item_model_iter_nth_child (GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *parent, gint n)
+{
+    ItemModel *im = ITEM_MODEL (model);
 
-    g_free (plpath);
-    g_free (ppath);
+    if (parent || n < 0 || n >= im->rows->len)
+    {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    item_model_set_iter (im, iter, n);
+    return TRUE;
 }
 
+static gboolean item_model_iter_parent (GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *child)
+{
+    return FALSE;
+}
 
-/*----------------------------------------------------------------------------*/
-/* Catalogue management                                                       */
-/*----------------------------------------------------------------------------*/
+/* item_model_new - create a model showing the given items of one category of a catalogue; takes the row list */
 
-#define N_REMAPS 1
+static ItemModel *item_model_new (catalogue_t *cat, int category, GArray *rows)
+{
+    ItemModel *model = g_object_new (ITEM_TYPE_MODEL, NULL);
 
-const char *titlemap[N_REMAPS][2] = {
-    {"Raspberry Pi Beginner's Guide 5th edition",   NULL}
-};
+    model->cat = cat;
+    model->category = category;
+    g_array_free (model->rows, TRUE);
+    model->rows = rows;
+    return model;
+}
+
+/* item_model_find - the row showing a shelf item, or -1; rows are in title order, so this is a search on rank */
 
-static void remap_title (char **title)
+static int item_model_find (ItemModel *model, guint32 index)
 {
-    int i;
+    GArray *items = model->cat->items;
+    guint32 rank = g_array_index (items, item_t, index).rank, r;
+    int lo = 0, hi = model->rows->len - 1, mid;
 
-    for (i = 0; i < N_REMAPS; i++)
+    while (lo <= hi)
     {
-        if (!g_strcmp0 (*title, titlemap[i][0]))
-        {
-            g_free (*title);
-            *title = g_strdup (titlemap[i][1]);
-            return;
-        }
+        mid = (lo + hi) / 2;
+        r = g_array_index (items, item_t, g_array_index (model->rows, guint32, mid)).rank;
+        if (r == rank) return mid;
+        if (r < rank) lo = mid + 1;
+        else hi = mid - 1;
     }
+    return -1;
 }
 
-/* download_catalogue - initiate curl download of appropriate catalogue XML file */
+/* merge_rows - count the rows which would come and go in changing a model to show a new list, making the changes if apply is set */
 
-static void download_catalogue (void)
+static guint merge_rows (ItemModel *model, GArray *rows, gboolean apply)
 {
-    char *access_key, *path;
-    size_t len;
-    FILE *fp;
-
-    catpath = g_strdup_printf ("%s%s%s", g_get_home_dir (), CACHE_PATH, "cat.xml");
-    cbpath = g_strdup_printf ("%s%s%s", g_get_home_dir (), CACHE_PATH, "catbak.xml");
+    GArray *items = model->cat->items;
+    GtkTreePath *path;
+    GtkTreeIter iter;
+    guint32 cur, want;
+    guint pos = 0, n = 0, changes = 0;
+
+    // both lists are in title order, so one walk along them finds every difference
+    while (pos < model->rows->len || n < rows->len)
+    {
+        cur = pos < model->rows->len ? g_array_index (items, item_t, g_array_index (model->rows, guint32, pos)).rank : G_MAXUINT32;
+        want = n < rows->len ? g_array_index (items, item_t, g_array_index (rows, guint32, n)).rank : G_MAXUINT32;
+        if (cur == want)
+        {
+            pos++;
+            n++;
+            continue;
+        }
 
-    message (_("Reading list of publications - please wait..."), FALSE);
+        changes++;
+        if (!apply)
+        {
+            // counting without changing anything, so step past the row as if it had been dealt with
+            if (cur < want) pos++;
+            else n++;
+            continue;
+        }
 
-    access_key = NULL;
-    path = g_build_filename (g_get_home_dir (), CACHE_PATH, "access_key", NULL);
-    fp = fopen (path, "r");
-    if (fp)
-    {
-        if (getline (&access_key, &len, fp) <= 1)
+        path = gtk_tree_path_new_from_indices (pos, -1);
+        model->stamp++;
+        if (cur < want)
         {
-            g_free (access_key);
-            access_key = NULL;
+            g_array_remove_index (model->rows, pos);
+            gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
         }
-        fclose (fp);
+        else
+        {
+            g_array_insert_val (model->rows, pos, g_array_index (rows, guint32, n));
+            item_model_set_iter (model, &iter, pos);
+            gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+            pos++;
+            n++;
+        }
+        gtk_tree_path_free (path);
     }
-
-    if (access_key)
-        start_curl_download (CONTRIBUTOR_URL, catpath, load_contrib_catalogue, access_key);
-    else
-        start_curl_download (CATALOGUE_URL, catpath, load_catalogue, NULL);
+    return changes;
 }
 
-/* load_catalogue - open a catalogue file - either main, backup or fallback */
+/* item_changed - tell the view showing a shelf item, if any, that the item has changed */
 
-static void load_catalogue (tf_status success)
+static void item_changed (int index)
 {
-    hide_message ();
-
-    switch (success)
-    {
-        case SUCCESS :  if (read_data_file (catpath))
-                        {
-                            gchar *cmd = g_strdup_printf ("cp %s %s", catpath, cbpath);
-                            system (cmd);
-                            g_free (cmd);
-                            return;
-                        }
-                        message (_("Downloaded catalogue not valid"), TRUE);
-                        read_data_file (cbpath);
-                        break;
-
-        case NOSPACE :  message (_("Disk full - unable to download updates"), TRUE);
-                        read_data_file (cbpath);
-                        break;
+    ItemModel *model = filtered[g_array_index (shelf->items, item_t, index).category];
+    GtkTreePath *path;
+    GtkTreeIter iter;
+    int pos;
+
+    if ((pos = item_model_find (model, index)) == -1) return;
+    item_model_set_iter (model, &iter, pos);
+    path = gtk_tree_path_new_from_indices (pos, -1);
+    gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+    gtk_tree_path_free (path);
+}
 
-        case FAILURE :  message (_("Unable to download updates"), TRUE);
-                        read_data_file (cbpath);
-                        break;
+/*----------------------------------------------------------------------------*/
+/* Search                                                                     */
+/*----------------------------------------------------------------------------*/
 
-        default :       break;
-    }
-}
+/* fold_text - append text in a form for matching - decomposed, case-folded and without accents */
 
-static void load_contrib_catalogue (tf_status success)
+static void fold_text (GString *out, const char *str)
 {
-    hide_message ();
+    char *norm, *fold, *ptr;
+    gunichar c;
 
-    switch (success)
+    norm = g_utf8_normalize (str, -1, G_NORMALIZE_ALL);
+    if (!norm) return;
+    fold = g_utf8_casefold (norm, -1);
+    for (ptr = fold; *ptr; ptr = g_utf8_next_char (ptr))
     {
-        case SUCCESS :  if (read_data_file (catpath))
-                        {
-                            gchar *cmd = g_strdup_printf ("cp %s %s", catpath, cbpath);
-                            system (cmd);
-                            g_free (cmd);
-                            return;
-                        }
-                        message (_("Downloaded catalogue not valid"), TRUE);
-                        read_data_file (cbpath);
-                        break;
-
-        case NOSPACE :  message (_("Disk full - unable to download updates"), TRUE);
-                        read_data_file (cbpath);
-                        break;
-
-        case FAILURE :  message (_("Could not validate your subscription. Try logging in again."), -1);
-                        break;
-
-        default :       break;
+        c = g_utf8_get_char (ptr);
+        if (!g_unichar_ismark (c)) g_string_append_unichar (out, c);
     }
+    g_free (fold);
+    g_free (norm);
 }
 
-/* get_param - helper function to look for tag in line */
+/* trigram - key for the three bytes at str; bytes rather than characters, as a substring of folded text is a substring of its bytes */
 
-static void get_param (char *linebuf, char *name, char *lang, char **dest)
+static guint32 trigram (const char *str)
 {
-    char *p1, *p2, *search;
+    return ((guint8) str[0] << 16) | ((guint8) str[1] << 8) | (guint8) str[2];
+}
 
-    if (lang) search = g_strdup_printf ("<%s LANG=\"%s\">", name, lang);
-    else search = g_strdup_printf ("<%s>", name);
-    
-    if ((p1 = strstr (linebuf, search)))
+/* build_search_index - fold the text of each item in a catalogue, and list the items each trigram appears in */
+
+static search_index_t *build_search_index (catalogue_t *cat)
+{
+    search_index_t *idx;
+    item_t *item;
+    GArray *list;
+    guint32 i, off, key;
+    const char *ptr;
+
+    idx = g_new0 (search_index_t, 1);
+    idx->text = g_string_new (NULL);
+    idx->offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), cat->items->len);
+    idx->trigrams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+
+    for (i = 0; i < cat->items->len; i++)
     {
-        p1 += strlen (search);
-        p2 = strchr (p1, '<');
-        if (p2)
+        item = &g_array_index (cat->items, item_t, i);
+
+        // title and description are separated by a newline, which a search cannot contain, so no match spans both
+        off = idx->text->len;
+        g_array_append_val (idx->offsets, off);
+        fold_text (idx->text, item->title);
+        g_string_append_c (idx->text, '\n');
+        fold_text (idx->text, item->desc);
+        g_string_append_c (idx->text, 0);
+
+        // lists stay sorted and free of repeats because items are added in order
+        for (ptr = idx->text->str + off; ptr[0] && ptr[1] && ptr[2]; ptr++)
         {
-            *p2 = 0;
-            *dest = g_strdup (p1);
+            key = trigram (ptr);
+            list = g_hash_table_lookup (idx->trigrams, GUINT_TO_POINTER (key));
+            if (!list)
+            {
+                list = g_array_new (FALSE, FALSE, sizeof (guint32));
+                g_hash_table_insert (idx->trigrams, GUINT_TO_POINTER (key), list);
+            }
+            if (!list->len || g_array_index (list, guint32, list->len - 1) != i) g_array_append_val (list, i);
         }
     }
-    g_free (search);
+    return idx;
 }
 
-/* read_data_file - main file parser routine */
+/* free_search_index - release a search index */
 
-static int read_data_file (char *path)
+static void free_search_index (search_index_t *idx)
 {
-    char *linebuf = NULL, *lang, *title = NULL, *desc = NULL, *covpath = NULL, *pdfpath = NULL, *filepath = NULL, *tr_title = NULL, *tr_desc = NULL, *tr_covpath = NULL, *tr_pdfpath = NULL, *tr_filepath = NULL, *lpath;
-    size_t nchars = 0;
-    GtkTreeIter entry;
-    int i, category = -1, in_item = FALSE, downloaded, counts[NUM_CATS], count = 0;
-    gboolean locked_items = FALSE;
-
-    gtk_list_store_clear (items);
+    if (!idx) return;
+    g_string_free (idx->text, TRUE);
+    g_array_free (idx->offsets, TRUE);
+    g_hash_table_destroy (idx->trigrams);
+    g_free (idx);
+}
 
-    for (i = 0; i < NUM_CATS; i++) counts[i] = 0;
+/* run_search - work out which items match the search text */
 
-    FILE *fp = fopen (path, "rb");
-    if (fp)
+static void run_search (void)
+{
+    GString *query;
+    GArray *list, *best = NULL;
+    const char *ptr;
+    guint32 i, n;
+
+    query = g_string_new (NULL);
+    fold_text (query, gtk_entry_get_text (GTK_ENTRY (search_box)));
+    search_all = !query->len || !search_idx || !search_idx->offsets->len;
+    g_free (search_match);
+    search_match = NULL;
+    if (search_all)
     {
-        lang = get_string ("grep LANG= /etc/default/locale | cut -d= -f2 | cut -d_ -f1");
+        g_string_free (query, TRUE);
+        return;
+    }
 
-        while (getline (&linebuf, &nchars, fp) != -1)
+    n = search_idx->offsets->len;
+    search_match = g_new0 (guint8, n ? n : 1);
+    if (query->len < 3)
+    {
+        // too short to have a trigram, but short queries are cheap to check directly
+        for (i = 0; i < n; i++)
+            search_match[i] = !!strstr (search_idx->text->str + g_array_index (search_idx->offsets, guint32, i), query->str);
+    }
+    else
+    {
+        // only the items in the shortest list of any of the query's trigrams can match; if one has no list, nothing does
+        for (ptr = query->str; ptr[2]; ptr++)
         {
-            if (in_item)
-            {
-                if (strstr (linebuf, "</ITEM>"))
-                {
-                    if (category == CAT_BOOKS) remap_title (&title);
-
-                    // item end flag - add the entry
-                    if (title && desc && covpath && (pdfpath || filepath))
-                    {
-                        if (tr_title)
-                        {
-                            g_free (title);
-                            title = tr_title;
-                        }
-                        else entitle (title);
-                        if (tr_desc)
-                        {
-                            g_free (desc);
-                            desc = tr_desc;
-                        }
-                        if (tr_covpath)
-                        {
-                            g_free (covpath);
-                            covpath = tr_covpath;
-                        }
-                        if (tr_pdfpath)
-                        {
-                            g_free (pdfpath);
-                            pdfpath = tr_pdfpath;
-                        }
-                        if (tr_filepath)
-                        {
-                            g_free (filepath);
-                            filepath = tr_filepath;
-                        }
-                        downloaded = FILE_AVAILABLE;
-                        if (pdfpath)
-                        {
-                            lpath = get_system_path (pdfpath);
-                            if (access (lpath, F_OK) != -1) downloaded = FILE_DOWNLOADED;
-                            g_free (lpath);
-                            lpath = get_local_path (pdfpath, PDF_PATH);
-                            if (access (lpath, F_OK) != -1) downloaded = FILE_DOWNLOADED;
-                            g_free (lpath);
-                        }
-                        else if (filepath)
-                        {
-                            locked_items = TRUE;
-                            downloaded = FILE_LOCKED;
-                            lpath = get_system_path (filepath);
-                            if (access (lpath, F_OK) != -1) downloaded = FILE_DOWNLOADED;
-                            g_free (lpath);
-                            lpath = get_local_path (filepath, PDF_PATH);
-                            if (access (lpath, F_OK) != -1) downloaded = FILE_DOWNLOADED;
-                            g_free (lpath);
-                        }
-                        gtk_list_store_append (items, &entry);
-                        gtk_list_store_set (items, &entry, ITEM_CATEGORY, category, ITEM_TITLE, title,
-                            ITEM_DESC, desc, ITEM_PDFPATH, pdfpath ? pdfpath : filepath, ITEM_COVPATH, covpath,
-                            ITEM_COVER, downloaded ? (downloaded == FILE_LOCKED ? nolock : nocover) : nodl, ITEM_DOWNLOADED, downloaded, -1);
-                    }
-                    in_item = FALSE;
-                    g_free (title);
-                    g_free (desc);
-                    g_free (covpath);
-                    g_free (pdfpath);
-                    title = desc = covpath = pdfpath = NULL;
-                    tr_title = tr_desc = tr_covpath = tr_pdfpath = tr_filepath = NULL;
-                    counts[category]++;
-                    count++;
-                }
-                get_param (linebuf, "TITLE", NULL, &title);
-                get_param (linebuf, "DESC", NULL, &desc);
-                get_param (linebuf, "COVER", NULL, &covpath);
-                get_param (linebuf, "PDF", NULL, &pdfpath);
-                get_param (linebuf, "FILE", NULL, &filepath);
-                get_param (linebuf, "TITLE", lang, &tr_title);
-                get_param (linebuf, "DESC", lang, &tr_desc);
-                get_param (linebuf, "COVER", lang, &tr_covpath);
-                get_param (linebuf, "PDF", lang, &tr_pdfpath);
-                get_param (linebuf, "FILE", lang, &tr_filepath);
-            }   
-            else
-            {
-                if (strstr (linebuf, "<MAGPI>")) category = CAT_MAGPI;
-                if (strstr (linebuf, "<BOOKS>")) category = CAT_BOOKS;
-                if (strstr (linebuf, "<ITEM>")) in_item = TRUE;
-            }
+            list = g_hash_table_lookup (search_idx->trigrams, GUINT_TO_POINTER (trigram (ptr)));
+            if (!list || !best || list->len < best->len) best = list;
+            if (!best) break;
+        }
+        for (i = 0; best && i < best->len; i++)
+        {
+            n = g_array_index (best, guint32, i);
+            search_match[n] = !!strstr (search_idx->text->str + g_array_index (search_idx->offsets, guint32, n), query->str);
         }
-
-        fclose (fp);
-        g_free (lang);
     }
-    else return 0;
+    g_string_free (query, TRUE);
+}
 
-    gtk_widget_set_visible (contrib_btn, locked_items);
+/* filter_rows - list a category's items which pass the search, in title order */
 
-    // hide any tab with no entries
-    for (i = 0; i < NUM_CATS; i++)
-    {
-        gtk_widget_set_visible (gtk_notebook_get_nth_page (GTK_NOTEBOOK (items_nb), i), !!counts[i]);
-    }
-    if (!count) return count;
+static GArray *filter_rows (catalogue_t *cat, int category)
+{
+    GArray *order = cat->order[category], *rows;
+    guint32 i, idx;
 
-    // start loading covers
-    if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (items), &covitem))
+    if (search_all) return g_array_append_vals (g_array_sized_new (FALSE, FALSE, sizeof (guint32), order->len), order->data, order->len);
+
+    rows = g_array_new (FALSE, FALSE, sizeof (guint32));
+    for (i = 0; i < order->len; i++)
     {
-        cover_dl = TRUE;
-        g_idle_add (find_cover_for_item, NULL);
+        idx = g_array_index (order, guint32, i);
+        if (search_match[idx]) g_array_append_val (rows, idx);
     }
-    return count;
+    return rows;
 }
 
-/* match_category - filter function for tab pages */
+/* set_rows - change the rows a tab's model shows to a new list from the same shelf; takes the list */
 
-static gboolean match_category (GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+static void set_rows (int category, GArray *rows)
 {
-    int cat;
-    char *title;
-    const char *srch;
+    ItemModel *model = filtered[category];
 
-    gtk_tree_model_get (model, iter, ITEM_CATEGORY, &cat, ITEM_TITLE, &title, -1);
-    srch = gtk_entry_get_text (GTK_ENTRY (search_box));
-    if (cat == (long) data)
+    if (merge_rows (model, rows, FALSE) <= BULK_ROWS)
     {
-        if (!srch || strcasestr (title, srch))
-        {
-            g_free (title);
-            return TRUE;
-        }
+        merge_rows (model, rows, TRUE);
+        g_array_free (rows, TRUE);
+        return;
     }
-    g_free (title);
+
+    // the view lays out everything again once when given the model back, rather than moving things for each row
+    g_object_ref (model);
+    gtk_icon_view_set_model (GTK_ICON_VIEW (item_ivs[category]), NULL);
+    g_array_free (model->rows, TRUE);
+    model->rows = rows;
+    model->stamp++;
+    gtk_icon_view_set_model (GTK_ICON_VIEW (item_ivs[category]), GTK_TREE_MODEL (model));
+    g_object_unref (model);
+}
+
+/* refilter_tab - bring a tab's model up to date with the search */
+
+static void refilter_tab (int category)
+{
+    set_rows (category, filter_rows (shelf, category));
+}
+
+/* search_changed - handler for edits to the search box; the search is run once typing pauses */
+
+static gboolean search_timeout (gpointer data)
+{
+    search_timer = 0;
+    search_update ();
     return FALSE;
 }
 
-static void search_update (GtkSearchEntry *self, gpointer data)
+static void search_changed (GtkEditable *self, gpointer data)
 {
-    int i;
+    if (search_timer) g_source_remove (search_timer);
+    search_timer = 0;
 
-    for (i = 0; i < NUM_CATS; i++)
-    {
-        gtk_tree_model_filter_refilter (GTK_TREE_MODEL_FILTER (gtk_icon_view_get_model (GTK_ICON_VIEW (item_ivs[i]))));
-    }
+    // clearing the search is shown straight away
+    if (!*gtk_entry_get_text (GTK_ENTRY (search_box))) search_update ();
+    else search_timer = g_timeout_add (SEARCH_DELAY, search_timeout, NULL);
 }
 
-/* symlink_user_guide - check and create / delete symlinks to files in /usr/share/userguide */
+/* search_update - apply the search to the current tab; the others are refiltered when they are shown */
 
-static void symlink_user_guide (void)
+static void search_update (void)
 {
-    struct dirent *dp;
-    struct stat buf;
-    DIR *dfd;
-    char *pdpath, *spath, *dpath;
+    int i, page;
 
-    // loop through all files in PDF dir looking for old symlinks
-    pdpath = g_strdup_printf ("%s%s", g_get_home_dir (), PDF_PATH);
-    if ((dfd = opendir (pdpath)))
+    run_search ();
+    page = gtk_notebook_get_current_page (GTK_NOTEBOOK (items_nb));
+    for (i = 0; i < NUM_CATS; i++)
     {
-        while ((dp = readdir (dfd)))
-        {
-            spath = g_strdup_printf ("%s%s", GUIDE_PATH, dp->d_name);
-            dpath = g_strdup_printf ("%s%s", pdpath, dp->d_name);
-            if (lstat (dpath, &buf) != -1 && S_ISLNK (buf.st_mode))
-            {
-                // file is a symlink - if there is no corresponding file, delete the link
-                if (stat (spath, &buf) == -1) unlink (dpath);
-            }
-            g_free (spath);
-            g_free (dpath);
-        }
+        if (i == page) refilter_tab (i);
+        else search_stale[i] = TRUE;
     }
+    schedule_reprioritise ();
+}
 
-    // loop through all files in userguide dir creating new symlinks
-    if ((dfd = opendir (GUIDE_PATH)))
-    {
-        while ((dp = readdir (dfd)))
-        {
-            if (dp->d_name[0] == '.') continue;
-
-            spath = g_strdup_printf ("%s%s", GUIDE_PATH, dp->d_name);
-            dpath = g_strdup_printf ("%s%s", pdpath, dp->d_name);
-
-            // if file is not already present in dest, create a symlink to it
-            if (stat (dpath, &buf) == -1) symlink (spath, dpath);
+/* page_switched - handler for a change of tab; brings its filter up to date with the search */
 
-            g_free (spath);
-            g_free (dpath);
-        }
+static void page_switched (GtkNotebook *nb, GtkWidget *page, guint num, gpointer data)
+{
+    if (num < NUM_CATS && search_stale[num])
+    {
+        search_stale[num] = FALSE;
+        refilter_tab (num);
     }
-    g_free (pdpath);
+    schedule_reprioritise ();
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1136,7 +4747,9 @@ static void symlink_user_guide (void)
 
 static gboolean ok_clicked (GtkButton *button, gpointer data)
 {
-    hide_message ();
+    // a contributor catalogue which could not be read falls back to the public one
+    if (msg_wait == 1) hide_message ();
+    else download_fallback (button, data);
     return FALSE;
 }
 
@@ -1150,48 +4763,27 @@ static gboolean download_fallback (GtkButton *button, gpointer data)
 {
     // download the non-contributor file
     message (_("Reading list of publications - please wait..."), FALSE);
-    start_curl_download (CATALOGUE_URL, catpath, load_catalogue, NULL);
+    start_curl_download (CATALOGUE_URL, catpath, load_catalogue, NULL, NULL, NULL, XFER_MODAL | XFER_CONDITIONAL);
     return FALSE;
 }
 
 static void message (char *msg, int wait)
 {
-    if (!msg_dlg)
-    {
-        GtkBuilder *builder;
-
-        builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/rp_bookshelf.ui");
-
-        msg_dlg = (GtkWidget *) gtk_builder_get_object (builder, "modal");
-        gtk_window_set_transient_for (GTK_WINDOW (msg_dlg), GTK_WINDOW (main_dlg));
-
-        msg_msg = (GtkWidget *) gtk_builder_get_object (builder, "modal_msg");
-        msg_pb = (GtkWidget *) gtk_builder_get_object (builder, "modal_pb");
-        msg_ok = (GtkWidget *) gtk_builder_get_object (builder, "modal_ok");
-        msg_cancel = (GtkWidget *) gtk_builder_get_object (builder, "modal_cancel");
-
-        gtk_label_set_text (GTK_LABEL (msg_msg), msg);
-
-        g_object_unref (builder);
-    }
-    else gtk_label_set_text (GTK_LABEL (msg_msg), msg);
+    gtk_label_set_text (GTK_LABEL (msg_msg), msg);
+    msg_wait = wait;
 
     if (wait)
     {
-        if (wait == 1)
-            g_signal_connect (msg_ok, "clicked", G_CALLBACK (ok_clicked), NULL);
-        else
-            g_signal_connect (msg_ok, "clicked", G_CALLBACK (download_fallback), NULL);
         gtk_widget_hide (msg_cancel);
         gtk_widget_show (msg_ok);
         gtk_widget_hide (msg_pb);
     }
     else
     {
-        g_signal_connect (msg_cancel, "clicked", G_CALLBACK (cancel_clicked), NULL);
         gtk_widget_show (msg_cancel);
         gtk_widget_hide (msg_ok);
         gtk_widget_show (msg_pb);
+        pb_fraction = 0.0;
         gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (msg_pb), 0.0);
     }
 
@@ -1200,12 +4792,9 @@ static void message (char *msg, int wait)
 
 static void hide_message (void)
 {
-    if (msg_dlg)
-    {
-        gtk_widget_destroy (GTK_WIDGET (msg_dlg));
-        msg_dlg = NULL;
-        msg_pb = NULL;
-    }
+    // the dialog is kept for next time, so a pending progress update must not fire into it
+    if (pb_tick) gtk_widget_remove_tick_callback (msg_pb, pb_tick);
+    gtk_widget_hide (msg_dlg);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1214,11 +4803,9 @@ static void hide_message (void)
 
 static void item_selected (GtkIconView *iconview, GtkTreePath *path, gpointer user_data)
 {
-    GtkTreeIter fitem, sitem;
-    gtk_tree_model_get_iter (GTK_TREE_MODEL (user_data), &fitem, path);
-    gtk_tree_model_filter_convert_iter_to_child_iter (GTK_TREE_MODEL_FILTER (user_data), &sitem, &fitem);
-    gtk_tree_model_sort_convert_iter_to_child_iter (GTK_TREE_MODEL_SORT (sorted), &selitem, &sitem);
+    ItemModel *model = ITEM_MODEL (gtk_icon_view_get_model (iconview));
 
+    selitem = g_array_index (model->rows, guint32, gtk_tree_path_get_indices (path)[0]);
     pdf_selected ();
 }
 
@@ -1229,44 +4816,44 @@ static void handle_menu_open (GtkWidget *widget, gpointer user_data)
 
 static void handle_menu_delete_file (GtkWidget *widget, gpointer user_data)
 {
-    gchar *cpath, *ppath, *clpath, *plpath;
-    GdkPixbuf *cover;
-    int w, h;
-
-    gtk_tree_model_get (GTK_TREE_MODEL (items), &selitem, ITEM_COVPATH, &cpath, ITEM_PDFPATH, &ppath, -1);
-    plpath = get_local_path (ppath, PDF_PATH);
-    clpath = get_local_path (cpath, CACHE_PATH);
+    item_t *item;
+    gchar *name, *plpath;
 
+    if (selitem < 0) return;
+    item = &g_array_index (shelf->items, item_t, selitem);
+    plpath = get_local_path (item->pdfpath, PDF_PATH);
     remove (plpath);
+    g_free (plpath);
 
-    cover = get_cover (clpath);
-    w = gdk_pixbuf_get_width (cover);
-    h = gdk_pixbuf_get_height (cover);
-    gdk_pixbuf_composite (grey, cover, 0, 0, w, h, 0, 0, 1, 1, GDK_INTERP_BILINEAR, 128);
-    gdk_pixbuf_composite (strstr (ppath, "https://") ? cloud : padlock, cover, (w - 64) / 2, 32, 64, 64, (w - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
+    name = url_basename (item->pdfpath);
+    file_changed (name, FOUND_LOCAL, FALSE);
+    g_free (name);
+}
 
-    gtk_list_store_set (items, &selitem, ITEM_COVER, cover, ITEM_DOWNLOADED, strstr (ppath, "https://") ? FILE_AVAILABLE : FILE_LOCKED, -1);
-    refresh_icons ();
+static void handle_menu_cancel (GtkWidget *widget, gpointer user_data)
+{
+    transfer_t *xfer = item_transfer (user_data);
 
-    g_free (plpath);
-    g_free (clpath);
-    g_free (ppath);
-    g_free (cpath);
-    g_object_unref (cover);
+    if (xfer) cancel_transfer (xfer);
 }
 
 static void create_cs_menu (GdkEvent *event)
 {
     gchar *ppath, *plpath;
     GtkWidget *menu, *mi;
-    int dl;
 
-    gtk_tree_model_get (GTK_TREE_MODEL (items), &selitem, ITEM_PDFPATH, &ppath, ITEM_DOWNLOADED, &dl, -1);
+    ppath = g_array_index (shelf->items, item_t, selitem).pdfpath;
     plpath = get_local_path (ppath, PDF_PATH);
 
     menu = gtk_menu_new ();
 
-    if (access (plpath, F_OK) == -1)
+    if (item_transfer (ppath))
+    {
+        mi = gtk_menu_item_new_with_label (_("Cancel download"));
+        g_signal_connect_data (mi, "activate", G_CALLBACK (handle_menu_cancel), g_strdup (ppath), (GClosureNotify) g_free, 0);
+        gtk_menu_shell_append (GTK_MENU_SHELL (menu), mi);
+    }
+    else if (!(file_found (shelf->files, ppath) & FOUND_LOCAL))
     {
         mi = gtk_menu_item_new_with_label (_("Download & open item"));
         g_signal_connect (mi, "activate", G_CALLBACK (handle_menu_open), NULL);
@@ -1284,7 +4871,6 @@ static void create_cs_menu (GdkEvent *event)
     }
 
     g_free (plpath);
-    g_free (ppath);
 
     gtk_widget_show_all (menu);
     gtk_menu_popup_at_pointer (GTK_MENU (menu), event);
@@ -1292,18 +4878,16 @@ static void create_cs_menu (GdkEvent *event)
 
 static gboolean icon_clicked (GtkWidget *wid, GdkEventButton *event, gpointer user_data)
 {
-    GtkTreeIter fitem, sitem;
-    GtkTreeModel *ivm;
+    ItemModel *model;
 
     if (event->button == 3)
     {
         GtkTreePath *path = gtk_icon_view_get_path_at_pos (GTK_ICON_VIEW (user_data), event->x, event->y);
         if (path)
         {
-            ivm = gtk_icon_view_get_model (GTK_ICON_VIEW (user_data));
-            gtk_tree_model_get_iter (ivm, &fitem, path);
-            gtk_tree_model_filter_convert_iter_to_child_iter (GTK_TREE_MODEL_FILTER (ivm), &sitem, &fitem);
-            gtk_tree_model_sort_convert_iter_to_child_iter (GTK_TREE_MODEL_SORT (sorted), &selitem, &sitem);
+            model = ITEM_MODEL (gtk_icon_view_get_model (GTK_ICON_VIEW (user_data)));
+            selitem = g_array_index (model->rows, guint32, gtk_tree_path_get_indices (path)[0]);
+            gtk_tree_path_free (path);
             create_cs_menu ((GdkEvent *) event);
         }
         return TRUE;
@@ -1311,38 +4895,23 @@ static gboolean icon_clicked (GtkWidget *wid, GdkEventButton *event, gpointer us
     return FALSE;
 }
 
-static void refresh_icons (void)
-{
-    int i;
-    for (i = 0; i < NUM_CATS; i++) gtk_widget_queue_draw (item_ivs[i]);
-}
+/* show_progress - cell data function to show a progress bar on tiles with a download queued or running, or why it stopped */
 
-static gint pub_sort (GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b, gpointer user_data)
+static void show_progress (GtkCellLayout *layout, GtkCellRenderer *renderer, GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
 {
-    int cata, catb, issuea, issueb, res;
-    char *titlea, *titleb;
-
-    gtk_tree_model_get (model, a, ITEM_CATEGORY, &cata, ITEM_TITLE, &titlea, -1);
-    gtk_tree_model_get (model, b, ITEM_CATEGORY, &catb, ITEM_TITLE, &titleb, -1);
+    const char *text = NULL;
+    int prog;
 
-    if (!titlea || !titleb) res = 0;
-    else if (cata != catb)
-    {
-        if (cata == CAT_MAGPI) res = -1;
-        else res = 1;
-    }
-    else if (cata == CAT_MAGPI)
-    {
-        issuea = issueb = 0;
-        sscanf (titlea, "Issue %d", &issuea);
-        sscanf (titleb, "Issue %d", &issueb);
-        res = issueb - issuea;
-    }
-    else res = strcasecmp (titlea, titleb);
+    gtk_tree_model_get (model, iter, ITEM_PROGRESS, &prog, -1);
+    if (prog == PROGRESS_FAILED) text = _("Download failed");
+    else if (prog == PROGRESS_NOSPACE) text = _("Disk full");
+    g_object_set (renderer, "visible", prog != -1, "value", MAX (prog, 0), "text", text, NULL);
+}
 
-    g_free (titlea);
-    g_free (titleb);
-    return res;
+static void refresh_icons (void)
+{
+    int i;
+    for (i = 0; i < NUM_CATS; i++) gtk_widget_queue_draw (item_ivs[i]);
 }
 
 static void web_link (GtkButton* btn, gpointer ptr)
@@ -1380,12 +4949,25 @@ static void close_prog (GtkButton* btn, gpointer ptr)
 
 static gboolean first_draw (GtkWidget *instance)
 {
+    g_debug ("first frame drawn %" G_GINT64_FORMAT " ms after start", (g_get_monotonic_time () - start_time) / 1000);
+
+    // nothing from here on is needed to put the window up, so it waits until it is
+    create_dir (THUMB_PATH);
+    create_dir (COVER_PATH);
+    create_dir (PDF_PATH);
+    symlink_user_guide ();
+    watch_dirs ();
+    load_overlays ();
+    init_kernels ();
+
 //#define LOCAL_TEST
 #ifdef LOCAL_TEST
-    load_catalogue (SUCCESS);
+    load_catalogue (SUCCESS, NULL);
 #else
+    read_data_file (catpath, READ_PRELOAD);
     download_catalogue ();
  #endif
+    trim_cache ();
     g_signal_handler_disconnect (instance, draw_id);
     return FALSE;
 }
@@ -1401,6 +4983,9 @@ int main (int argc, char *argv[])
     GtkCellRenderer *renderer;
     long i;
 
+    start_time = g_get_monotonic_time ();
+    init_trace ();
+
     if (argc > 1) url_arg = g_strdup (argv[1]);
     else url_arg = g_strdup_printf ("<none>");
     init_dbus ();
@@ -1412,15 +4997,19 @@ int main (int argc, char *argv[])
     textdomain (GETTEXT_PACKAGE);
 #endif
 
-    // check that directories exist
+    catpath = g_strdup_printf ("%s%s%s", g_get_home_dir (), CACHE_PATH, "cat.xml");
+    cbpath = g_strdup_printf ("%s%s%s", g_get_home_dir (), CACHE_PATH, "catbak.xml");
+
+    // check that directories exist - just the one the access key is saved in, the rest wait for first_draw
     create_dir ("/.cache/");
     create_dir (CACHE_PATH);
-    create_dir (PDF_PATH);
 
-    // check user guide symlinks
-    symlink_user_guide ();
+    load_config ();
+    init_curl ();
 
-    curl_global_init (CURL_GLOBAL_ALL);
+    // one cover preparation thread per core
+    done_covers = g_async_queue_new ();
+    cover_pool = g_thread_pool_new (cover_worker, NULL, g_get_num_processors (), FALSE, NULL);
 
     // terminate zombies automatically
     signal (SIGCHLD, SIG_IGN);
@@ -1432,19 +5021,8 @@ int main (int argc, char *argv[])
     gtk_init (&argc, &argv);
     gtk_icon_theme_prepend_search_path (gtk_icon_theme_get_default(), PACKAGE_DATA_DIR);
 
-    cloud = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/cloud.png", NULL);
-    grey = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/grey.png", NULL);
-    padlock = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/padlock.png", NULL);
-    newcorn = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/new.png", NULL);
-    nocover = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/nocover.png", NULL);
-    nodl = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/nocover.png", NULL);
-    i = gdk_pixbuf_get_width (nodl);
-    gdk_pixbuf_composite (cloud, nodl, (i - 64) / 2, 32, 64, 64, (i - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
-    nolock = gdk_pixbuf_new_from_file (PACKAGE_DATA_DIR "/nocover.png", NULL);
-    gdk_pixbuf_composite (padlock, nolock, (i - 64) / 2, 32, 64, 64, (i - 64) / 2, 32, 1, 1, GDK_INTERP_BILINEAR, 255);
-
-    // build the UI
-    builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/rp_bookshelf.ui");
+    // build the UI - the modal is built along with the main window, and kept for every message
+    builder = gtk_builder_new_from_resource (RESOURCE_PATH "rp_bookshelf.ui");
 
     main_dlg = (GtkWidget *) gtk_builder_get_object (builder, "main_window");
     item_ivs[CAT_MAGPI] = (GtkWidget *) gtk_builder_get_object (builder, "iconview_magpi");
@@ -1454,18 +5032,16 @@ int main (int argc, char *argv[])
     contrib_btn = (GtkWidget *) gtk_builder_get_object (builder, "button_contrib");
     items_nb = (GtkWidget *) gtk_builder_get_object (builder, "notebook1");
     search_box = (GtkWidget *) gtk_builder_get_object (builder, "srch");
-
-    // create and sort list store
-    items = gtk_list_store_new (7, G_TYPE_INT, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, GDK_TYPE_PIXBUF);
-    sorted = gtk_tree_model_sort_new_with_model (GTK_TREE_MODEL (items));
-    gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (sorted), ITEM_TITLE, GTK_SORT_ASCENDING);
-    gtk_tree_sortable_set_sort_func (GTK_TREE_SORTABLE (sorted), ITEM_TITLE, pub_sort, NULL, NULL);
-
-    // create filtered lists and set up icon views
+    msg_dlg = (GtkWidget *) gtk_builder_get_object (builder, "modal");
+    msg_msg = (GtkWidget *) gtk_builder_get_object (builder, "modal_msg");
+    msg_pb = (GtkWidget *) gtk_builder_get_object (builder, "modal_pb");
+    msg_ok = (GtkWidget *) gtk_builder_get_object (builder, "modal_ok");
+    msg_cancel = (GtkWidget *) gtk_builder_get_object (builder, "modal_cancel");
+    gtk_window_set_transient_for (GTK_WINDOW (msg_dlg), GTK_WINDOW (main_dlg));
+
+    // set up icon views
     for (i = 0; i < NUM_CATS; i++)
     {
-        filtered[i] = gtk_tree_model_filter_new (GTK_TREE_MODEL (sorted), NULL);
-        gtk_tree_model_filter_set_visible_func (GTK_TREE_MODEL_FILTER (filtered[i]), (GtkTreeModelFilterVisibleFunc) match_category, (gpointer) i, NULL);
         gtk_icon_view_set_tooltip_column (GTK_ICON_VIEW (item_ivs[i]), ITEM_DESC);
         layout = GTK_CELL_LAYOUT (item_ivs[i]);
 
@@ -1474,40 +5050,52 @@ int main (int argc, char *argv[])
         gtk_cell_layout_pack_start (layout, renderer, FALSE);
         gtk_cell_layout_add_attribute (layout, renderer, "pixbuf", ITEM_COVER);
 
+        renderer = gtk_cell_renderer_progress_new ();
+        gtk_cell_renderer_set_fixed_size (renderer, COVER_SIZE, -1);
+        gtk_cell_layout_pack_start (layout, renderer, FALSE);
+        gtk_cell_layout_set_cell_data_func (layout, renderer, show_progress, NULL, NULL);
+
         renderer = gtk_cell_renderer_text_new ();
         gtk_cell_renderer_set_alignment (renderer, 0.5, 0.0);
         g_object_set (renderer, "wrap-width", CELL_WIDTH, "wrap-mode", PANGO_WRAP_WORD, "alignment", PANGO_ALIGN_CENTER, NULL);
         gtk_cell_layout_pack_start (layout, renderer, FALSE);
         gtk_cell_layout_add_attribute (layout, renderer, "markup", ITEM_TITLE);
 
-        gtk_icon_view_set_model (GTK_ICON_VIEW (item_ivs[i]), filtered[i]);
-        g_signal_connect (item_ivs[i], "item-activated", G_CALLBACK (item_selected), filtered[i]);
+        g_signal_connect (item_ivs[i], "item-activated", G_CALLBACK (item_selected), NULL);
         g_signal_connect (item_ivs[i], "button-press-event", G_CALLBACK (icon_clicked), item_ivs[i]);
+        g_signal_connect_swapped (gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (item_ivs[i])), "value-changed", G_CALLBACK (schedule_reprioritise), NULL);
     }
 
+    // start with an empty shelf, so the views have models
+    attach_shelf (new_catalogue ());
+    cover_order = g_array_new (FALSE, FALSE, sizeof (int));
+
     g_signal_connect (web_btn, "clicked", G_CALLBACK (web_link), NULL);
     g_signal_connect (contrib_btn, "clicked", G_CALLBACK (contribute), NULL);
     g_signal_connect (close_btn, "clicked", G_CALLBACK (close_prog), NULL);
     g_signal_connect (main_dlg, "delete_event", G_CALLBACK (close_prog), NULL);
-    g_signal_connect (search_box, "search-changed", G_CALLBACK (search_update), NULL);
+    g_signal_connect (search_box, "changed", G_CALLBACK (search_changed), NULL);
+    g_signal_connect (items_nb, "switch-page", G_CALLBACK (page_switched), NULL);
+    g_signal_connect (msg_ok, "clicked", G_CALLBACK (ok_clicked), NULL);
+    g_signal_connect (msg_cancel, "clicked", G_CALLBACK (cancel_clicked), NULL);
+    g_signal_connect (msg_dlg, "delete-event", G_CALLBACK (gtk_widget_hide_on_delete), NULL);
 
     gtk_widget_show_all (main_dlg);
     gtk_widget_hide (contrib_btn);
     gtk_widget_hide (web_btn);
     gtk_widget_grab_focus (close_btn);
-    msg_dlg = NULL;
-    msg_pb = NULL;
 
     // update catalogue
-    cover_dl = FALSE;
-    pdf_dl_req = FALSE;
     draw_id = g_signal_connect (main_dlg, "draw", G_CALLBACK (first_draw), NULL);
 
     gtk_main ();
 
     g_object_unref (builder);
+    g_thread_pool_free (cover_pool, TRUE, TRUE);
     gtk_widget_destroy (main_dlg);
+    close_curl ();
     close_dbus ();
+    write_trace ();
     return 0;
 }
 
@@ -0,0 +1,100 @@
+/*============================================================================
+Cover kernel benchmark - times the scalar kernels against each SIMD kernel
+this CPU can run, on rows the size of a cover
+
+Usage: bench-kernels [rows] [runs]
+============================================================================*/
+
+#define main rp_bookshelf_main
+#include "rp_bookshelf.c"
+#undef main
+
+#define DEFAULT_ROWS    200000
+#define DEFAULT_RUNS    5
+#define ROW_LEN         (COVER_SIZE * 3)
+
+typedef void (*accumulate_fn) (guint16 *acc, const guint8 *src, int len, guint16 weight);
+typedef void (*blend_fn) (guint8 *dst, const guint8 *pre, const guint8 *inv, int len);
+
+static guint16 acc[ROW_LEN];
+static guint8 src[ROW_LEN], dst[ROW_LEN], pre[ROW_LEN], inv[ROW_LEN];
+static int rows, runs;
+
+/* time_accumulate - best of several runs of a kernel over many rows, in microseconds */
+
+static gint64 time_accumulate (accumulate_fn fn)
+{
+    gint64 start, best = G_MAXINT64;
+    int run, r;
+
+    for (run = 0; run < runs; run++)
+    {
+        memset (acc, 0, sizeof (acc));
+        start = g_get_monotonic_time ();
+        for (r = 0; r < rows; r++) fn (acc, src, ROW_LEN, (r & 0xFF) + 1);
+        best = MIN (best, g_get_monotonic_time () - start);
+    }
+    return best;
+}
+
+/* time_blend - best of several runs of a kernel over many rows, in microseconds */
+
+static gint64 time_blend (blend_fn fn)
+{
+    gint64 start, best = G_MAXINT64;
+    int run, r;
+
+    for (run = 0; run < runs; run++)
+    {
+        start = g_get_monotonic_time ();
+        for (r = 0; r < rows; r++) fn (dst, pre, inv, ROW_LEN);
+        best = MIN (best, g_get_monotonic_time () - start);
+    }
+    return best;
+}
+
+/* report - one line of results, with the speed-up over the scalar kernel */
+
+static void report (const char *name, gint64 acc_us, gint64 blend_us, gint64 acc_ref, gint64 blend_ref)
+{
+    double bytes = (double) rows * ROW_LEN;
+
+    printf ("%-8s accumulate_row %7.3f ns/byte (%4.1fx)   blend_span %7.3f ns/byte (%4.1fx)\n", name,
+        acc_us * 1000.0 / bytes, acc_us ? (double) acc_ref / acc_us : 0.0,
+        blend_us * 1000.0 / bytes, blend_us ? (double) blend_ref / blend_us : 0.0);
+}
+
+int main (int argc, char *argv[])
+{
+    gint64 acc_c, blend_c;
+    int i, a;
+
+    rows = argc > 1 ? atoi (argv[1]) : DEFAULT_ROWS;
+    runs = argc > 2 ? atoi (argv[2]) : DEFAULT_RUNS;
+    if (rows < 1 || runs < 1) return 1;
+
+    for (i = 0; i < ROW_LEN; i++)
+    {
+        a = g_random_int_range (0, 256);
+        src[i] = dst[i] = g_random_int_range (0, 256);
+        pre[i] = (g_random_int_range (0, 256) * a + 127) / 255;
+        inv[i] = 255 - a;
+    }
+
+    printf ("%d rows of %d bytes, best of %d runs\n", rows, ROW_LEN, runs);
+    acc_c = time_accumulate (accumulate_row_c);
+    blend_c = time_blend (blend_span_c);
+    report ("scalar", acc_c, blend_c, acc_c, blend_c);
+#ifdef USE_SSE2
+    if (__builtin_cpu_supports ("sse2"))
+        report ("SSE2", time_accumulate (accumulate_row_sse2), time_blend (blend_span_sse2), acc_c, blend_c);
+#endif
+#ifdef USE_NEON
+    if (cpu_has_neon ())
+        report ("NEON", time_accumulate (accumulate_row_neon), time_blend (blend_span_neon), acc_c, blend_c);
+#endif
+    return 0;
+}
+
+/* End of file                                                                */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,276 @@
+/*============================================================================
+Catalogue parser benchmark - times the single-pass parser against the
+line-by-line parser it replaced, on a generated catalogue, and checks that
+both produce the same items
+
+Usage: bench-parse [items] [runs]
+============================================================================*/
+
+#define main rp_bookshelf_main
+#include "rp_bookshelf.c"
+#undef main
+
+#define DEFAULT_ITEMS   50000
+#define DEFAULT_RUNS    5
+
+/* Line-by-line parser                                                        */
+/*----------------------------------------------------------------------------*/
+
+/* old_remap_title - the title remap as it was, on a whole allocated title */
+
+static void old_remap_title (char **title)
+{
+    int i;
+
+    for (i = 0; i < N_REMAPS; i++)
+    {
+        if (!g_strcmp0 (*title, titlemap[i][0]))
+        {
+            g_free (*title);
+            *title = g_strdup (titlemap[i][1]);
+            return;
+        }
+    }
+}
+
+/* old_get_param - look for a tag in a line, building the search string each time */
+
+static void old_get_param (char *linebuf, char *name, const char *lang, char **dest)
+{
+    char *p1, *p2, *search;
+
+    if (lang) search = g_strdup_printf ("<%s LANG=\"%s\">", name, lang);
+    else search = g_strdup_printf ("<%s>", name);
+
+    if ((p1 = strstr (linebuf, search)))
+    {
+        p1 += strlen (search);
+        p2 = strchr (p1, '<');
+        if (p2)
+        {
+            *p2 = 0;
+            *dest = g_strdup (p1);
+        }
+    }
+    g_free (search);
+}
+
+/* old_add_item - copy an item's strings into the catalogue's storage and add it */
+
+static void old_add_item (catalogue_t *cat, int category, char *title, char *desc, char *path, char *covpath, gboolean locked)
+{
+    add_item (cat, category, g_string_chunk_insert (cat->strings, title), g_string_chunk_insert (cat->strings, desc),
+        g_string_chunk_insert (cat->strings, path), g_string_chunk_insert (cat->strings, covpath), NULL,
+        item_status (cat->files, path, locked));
+}
+
+/* old_parse_catalogue - the getline parser, with ten tag searches on every line of an item */
+
+static catalogue_t *old_parse_catalogue (char *path, GHashTable *files)
+{
+    char *linebuf = NULL, *title = NULL, *desc = NULL, *covpath = NULL, *pdfpath = NULL, *filepath = NULL, *tr_title = NULL, *tr_desc = NULL, *tr_covpath = NULL, *tr_pdfpath = NULL, *tr_filepath = NULL;
+    const char *lang;
+    size_t nchars = 0;
+    int category = -1, in_item = FALSE;
+    catalogue_t *cat;
+
+    FILE *fp = fopen (path, "rb");
+    if (!fp) return NULL;
+
+    cat = new_catalogue ();
+    cat->strings = g_string_chunk_new (4096);
+    cat->files = g_hash_table_ref (files);
+    lang = get_lang ();
+
+    while (getline (&linebuf, &nchars, fp) != -1)
+    {
+        if (in_item)
+        {
+            if (strstr (linebuf, "</ITEM>"))
+            {
+                if (category == CAT_BOOKS) old_remap_title (&title);
+
+                // item end flag - add the entry
+                if (category >= 0 && title && desc && covpath && (pdfpath || filepath))
+                {
+                    if (tr_title)
+                    {
+                        g_free (title);
+                        title = tr_title;
+                    }
+                    else entitle (title);
+                    if (tr_desc)
+                    {
+                        g_free (desc);
+                        desc = tr_desc;
+                    }
+                    if (tr_covpath)
+                    {
+                        g_free (covpath);
+                        covpath = tr_covpath;
+                    }
+                    if (tr_pdfpath)
+                    {
+                        g_free (pdfpath);
+                        pdfpath = tr_pdfpath;
+                    }
+                    if (tr_filepath)
+                    {
+                        g_free (filepath);
+                        filepath = tr_filepath;
+                    }
+                    tr_title = tr_desc = tr_covpath = tr_pdfpath = tr_filepath = NULL;
+
+                    if (pdfpath) old_add_item (cat, category, title, desc, pdfpath, covpath, FALSE);
+                    else old_add_item (cat, category, title, desc, filepath, covpath, TRUE);
+                }
+                in_item = FALSE;
+                g_free (title);
+                g_free (desc);
+                g_free (covpath);
+                g_free (pdfpath);
+                g_free (filepath);
+                g_free (tr_title);
+                g_free (tr_desc);
+                g_free (tr_covpath);
+                g_free (tr_pdfpath);
+                g_free (tr_filepath);
+                title = desc = covpath = pdfpath = filepath = NULL;
+                tr_title = tr_desc = tr_covpath = tr_pdfpath = tr_filepath = NULL;
+            }
+            old_get_param (linebuf, "TITLE", NULL, &title);
+            old_get_param (linebuf, "DESC", NULL, &desc);
+            old_get_param (linebuf, "COVER", NULL, &covpath);
+            old_get_param (linebuf, "PDF", NULL, &pdfpath);
+            old_get_param (linebuf, "FILE", NULL, &filepath);
+            old_get_param (linebuf, "TITLE", lang, &tr_title);
+            old_get_param (linebuf, "DESC", lang, &tr_desc);
+            old_get_param (linebuf, "COVER", lang, &tr_covpath);
+            old_get_param (linebuf, "PDF", lang, &tr_pdfpath);
+            old_get_param (linebuf, "FILE", lang, &tr_filepath);
+        }
+        else
+        {
+            if (strstr (linebuf, "<MAGPI>")) category = CAT_MAGPI;
+            if (strstr (linebuf, "<BOOKS>")) category = CAT_BOOKS;
+            if (strstr (linebuf, "<ITEM>")) in_item = TRUE;
+        }
+    }
+    g_free (linebuf);
+    fclose (fp);
+    return cat;
+}
+
+/* Benchmark                                                                  */
+/*----------------------------------------------------------------------------*/
+
+/* write_fixture - a catalogue laid out like the real one - one field per line, some translated, some for contributors */
+
+static void write_fixture (const char *path, int nitems)
+{
+    FILE *fp = fopen (path, "w");
+    const char *lang = get_lang ();
+    int i;
+
+    g_assert_nonnull (fp);
+    fprintf (fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<PUBS>\n");
+    for (i = 0; i < nitems; i++)
+    {
+        if (i == 0) fprintf (fp, "  <MAGPI>\n");
+        if (i == nitems / 2) fprintf (fp, "  </MAGPI>\n  <BOOKS>\n");
+        fprintf (fp, "    <ITEM>\n");
+        if (i < nitems / 2) fprintf (fp, "      <TITLE>Issue %d</TITLE>\n", nitems / 2 - i);
+        else fprintf (fp, "      <TITLE>the book of making volume %d</TITLE>\n", i);
+        if (*lang && i % 7 == 0) fprintf (fp, "      <TITLE LANG=\"%s\">Translated title %d</TITLE>\n", lang, i);
+        fprintf (fp, "      <DESC>Projects, tutorials and reviews for item %d - includes 43 pages of making</DESC>\n", i);
+        fprintf (fp, "      <COVER>https://magazines-static.raspberrypi.org/issues/cover_images/%06d/large/cover-%d.jpg?1585064653</COVER>\n", i, i);
+        if (i % 5 == 4) fprintf (fp, "      <FILE>contributor-%d.pdf</FILE>\n", i);
+        else fprintf (fp, "      <PDF>https://magazines-static.raspberrypi.org/issues/full_pdfs/%06d/original/item-%d.pdf?1585064655</PDF>\n", i, i);
+        fprintf (fp, "    </ITEM>\n");
+    }
+    fprintf (fp, "  </BOOKS>\n</PUBS>\n");
+    fclose (fp);
+}
+
+/* check_same - both parsers must find the same items, in the same order */
+
+static gboolean check_same (catalogue_t *a, catalogue_t *b)
+{
+    item_t *ia, *ib;
+    int i;
+
+    if (a->items->len != b->items->len)
+    {
+        printf ("item counts differ: %u and %u\n", a->items->len, b->items->len);
+        return FALSE;
+    }
+    for (i = 0; i < a->items->len; i++)
+    {
+        ia = &g_array_index (a->items, item_t, i);
+        ib = &g_array_index (b->items, item_t, i);
+        if (ia->category != ib->category || ia->downloaded != ib->downloaded || strcmp (ia->title, ib->title)
+            || strcmp (ia->desc, ib->desc) || strcmp (ia->pdfpath, ib->pdfpath) || strcmp (ia->covpath, ib->covpath))
+        {
+            printf ("item %d differs: \"%s\" and \"%s\"\n", i, ia->title, ib->title);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* time_parser - best of several runs of a parser over the fixture, in microseconds */
+
+static gint64 time_parser (catalogue_t *(*parse) (char *, GHashTable *), char *path, GHashTable *files, int runs, catalogue_t **result)
+{
+    catalogue_t *cat;
+    gint64 start, best = G_MAXINT64;
+    int i;
+
+    for (i = 0; i < runs; i++)
+    {
+        start = g_get_monotonic_time ();
+        cat = parse (path, files);
+        best = MIN (best, g_get_monotonic_time () - start);
+        if (i < runs - 1) free_catalogue (cat);
+        else *result = cat;
+    }
+    return best;
+}
+
+int main (int argc, char *argv[])
+{
+    catalogue_t *old_cat, *new_cat;
+    GHashTable *files;
+    char *dir, *path;
+    gint64 old_us, new_us;
+    int nitems, runs;
+    gboolean same;
+
+    nitems = argc > 1 ? atoi (argv[1]) : DEFAULT_ITEMS;
+    runs = argc > 2 ? atoi (argv[2]) : DEFAULT_RUNS;
+    if (nitems < 2 || runs < 1) return 1;
+
+    dir = g_dir_make_tmp ("bookshelf-bench-XXXXXX", NULL);
+    g_assert_nonnull (dir);
+    path = g_build_filename (dir, "cat.xml", NULL);
+    write_fixture (path, nitems);
+    files = g_hash_table_new (g_str_hash, g_str_equal);
+
+    old_us = time_parser (old_parse_catalogue, path, files, runs, &old_cat);
+    new_us = time_parser (parse_catalogue, path, files, runs, &new_cat);
+    same = check_same (old_cat, new_cat);
+
+    printf ("%d items, best of %d runs\n", nitems, runs);
+    printf ("line-by-line parser: %8.2f ms\n", old_us / 1000.0);
+    printf ("single-pass parser:  %8.2f ms  (%.1fx)\n", new_us / 1000.0, new_us ? (double) old_us / new_us : 0.0);
+    printf ("items %s\n", same ? "match" : "DIFFER");
+
+    free_catalogue (old_cat);
+    free_catalogue (new_cat);
+    remove (path);
+    g_rmdir (dir);
+    return same ? 0 : 1;
+}
+
+/* End of file                                                                */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,100 @@
+/*============================================================================
+Segmented download benchmark - downloads the same file through the
+bookshelf's own transfer code as a single stream and then split into
+segments, and reports the throughput of each
+
+The file must be at least SEGMENT_MIN bytes, and its server must honour
+ranges and send a strong validator, for it to be split at all.
+
+Usage: bench-segments url [segments] [runs]
+============================================================================*/
+
+#define main rp_bookshelf_main
+#include "rp_bookshelf.c"
+#undef main
+
+#define DEFAULT_RUNS    3
+
+static GMainLoop *loop;
+static tf_status result;
+
+/* download_done - termination function; stops the main loop once the download has finished */
+
+static void download_done (tf_status success, gpointer data)
+{
+    result = success;
+    g_main_loop_quit (loop);
+}
+
+/* time_download - best of several downloads of a URL with a given number of segments, in microseconds */
+
+static gint64 time_download (char *url, char *path, int segments, int runs, curl_off_t *size)
+{
+    gint64 start, best = G_MAXINT64;
+    int run;
+
+    max_segments = segments;
+    for (run = 0; run < runs; run++)
+    {
+        remove (path);
+        start = g_get_monotonic_time ();
+        start_curl_download (url, path, download_done, NULL, NULL, NULL, XFER_SEGMENTED);
+        g_main_loop_run (loop);
+        if (result != SUCCESS) return -1;
+        best = MIN (best, g_get_monotonic_time () - start);
+    }
+    *size = file_size (path);
+    return best;
+}
+
+/* report - one line of results */
+
+static void report (int segments, gint64 us, curl_off_t size, gint64 single_us)
+{
+    printf ("%2d segment%s  %8.2f s  %8.2f MB/s  (%.2fx)\n", segments, segments == 1 ? " " : "s", us / 1e6,
+        size / (double) us, (double) single_us / us);
+}
+
+int main (int argc, char *argv[])
+{
+    char *dir, *path;
+    gint64 single_us, split_us = -1;
+    curl_off_t size;
+    int segments, runs;
+
+    if (argc < 2)
+    {
+        printf ("Usage: %s url [segments] [runs]\n", argv[0]);
+        return 1;
+    }
+    segments = argc > 2 ? atoi (argv[2]) : SEGMENTS;
+    runs = argc > 3 ? atoi (argv[3]) : DEFAULT_RUNS;
+    if (segments < 2 || runs < 1) return 1;
+
+    dir = g_dir_make_tmp ("bookshelf-bench-XXXXXX", NULL);
+    path = g_build_filename (dir, "download", NULL);
+    loop = g_main_loop_new (NULL, FALSE);
+    // segments count against the transfer limit, so it must leave room for them all
+    max_transfers = MAX (MAX_TRANSFERS, segments);
+    init_curl ();
+
+    single_us = time_download (argv[1], path, 1, runs, &size);
+    if (single_us < 0) printf ("download failed\n");
+    else
+    {
+        printf ("%s - %" CURL_FORMAT_CURL_OFF_T " bytes, best of %d runs\n", argv[1], size, runs);
+        if (size < SEGMENT_MIN) printf ("file is smaller than SEGMENT_MIN, so will not be split\n");
+        report (1, single_us, size, single_us);
+        split_us = time_download (argv[1], path, segments, runs, &size);
+        if (split_us < 0) printf ("segmented download failed\n");
+        else report (segments, split_us, size, single_us);
+    }
+
+    close_curl ();
+    remove (path);
+    g_rmdir (dir);
+    return split_us < 0;
+}
+
+/* End of file                                                                */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,154 @@
+/*============================================================================
+Tests for the cover pixel kernels - each SIMD kernel the CPU can run must give
+exactly the same bytes as the scalar kernel, on random data of every length
+around the vector width
+============================================================================*/
+
+#define main rp_bookshelf_main
+#include "rp_bookshelf.c"
+#undef main
+
+#define MAX_LEN     200
+#define ROUNDS      200
+
+typedef void (*accumulate_fn) (guint16 *acc, const guint8 *src, int len, guint16 weight);
+typedef void (*blend_fn) (guint8 *dst, const guint8 *pre, const guint8 *inv, int len);
+
+/* Helpers                                                                    */
+/*----------------------------------------------------------------------------*/
+
+/* fill_random - random bytes */
+
+static void fill_random (guint8 *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) buf[i] = g_random_int_range (0, 256);
+}
+
+/* fill_layer - a random span of overlay as make_layer would prepare it, so pre + dst * inv / 255 never exceeds 255 */
+
+static void fill_layer (guint8 *pre, guint8 *inv, int len)
+{
+    int i, a;
+
+    for (i = 0; i < len; i++)
+    {
+        // fully clear and fully opaque are the common cases in the real overlays
+        switch (g_random_int_range (0, 4))
+        {
+            case 0 :    a = 0;
+                        break;
+            case 1 :    a = 255;
+                        break;
+            default :   a = g_random_int_range (0, 256);
+                        break;
+        }
+        pre[i] = (g_random_int_range (0, 256) * a + 127) / 255;
+        inv[i] = 255 - a;
+    }
+}
+
+/* check_accumulate - run a kernel and the scalar kernel over the same rows, offset so the vector loads are unaligned too */
+
+static void check_accumulate (accumulate_fn fn)
+{
+    guint16 ref[MAX_LEN + 1], acc[MAX_LEN + 1];
+    guint8 src[MAX_LEN + 1];
+    guint16 weight;
+    int round, len, off;
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        len = round < MAX_LEN ? round : g_random_int_range (0, MAX_LEN);
+        off = g_random_int_range (0, 2);
+        weight = round % 3 ? g_random_int_range (0, 256) : g_random_int_range (0, 65536);
+
+        fill_random ((guint8 *) ref, sizeof (ref));
+        memcpy (acc, ref, sizeof (acc));
+        fill_random (src, sizeof (src));
+
+        // the accumulator wraps at 16 bits in every kernel, so any weight must agree
+        accumulate_row_c (ref + off, src + off, len, weight);
+        fn (acc + off, src + off, len, weight);
+        g_assert_cmpmem (acc, sizeof (acc), ref, sizeof (ref));
+    }
+}
+
+/* check_blend - run a kernel and the scalar kernel over the same spans */
+
+static void check_blend (blend_fn fn)
+{
+    guint8 ref[MAX_LEN + 1], dst[MAX_LEN + 1], pre[MAX_LEN + 1], inv[MAX_LEN + 1];
+    int round, len, off;
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        len = round < MAX_LEN ? round : g_random_int_range (0, MAX_LEN);
+        off = g_random_int_range (0, 2);
+
+        fill_random (ref, sizeof (ref));
+        memcpy (dst, ref, sizeof (dst));
+        fill_layer (pre, inv, sizeof (pre));
+
+        blend_span_c (ref + off, pre + off, inv + off, len);
+        fn (dst + off, pre + off, inv + off, len);
+        g_assert_cmpmem (dst, sizeof (dst), ref, sizeof (ref));
+    }
+}
+
+/* Tests                                                                      */
+/*----------------------------------------------------------------------------*/
+
+static void test_blend_exact (void)
+{
+    guint8 dst[3] = { 200, 0, 255 }, pre[3] = { 0, 255, 64 }, inv[3] = { 255, 0, 128 };
+
+    // clear leaves the cover alone, opaque replaces it, and half-way rounds to nearest
+    blend_span_c (dst, pre, inv, 3);
+    g_assert_cmpuint (dst[0], ==, 200);
+    g_assert_cmpuint (dst[1], ==, 255);
+    g_assert_cmpuint (dst[2], ==, 64 + 128);
+}
+
+#ifdef USE_SSE2
+static void test_sse2 (void)
+{
+    if (!__builtin_cpu_supports ("sse2"))
+    {
+        g_test_skip ("CPU has no SSE2");
+        return;
+    }
+    check_accumulate (accumulate_row_sse2);
+    check_blend (blend_span_sse2);
+}
+#endif
+
+#ifdef USE_NEON
+static void test_neon (void)
+{
+    if (!cpu_has_neon ())
+    {
+        g_test_skip ("CPU has no NEON");
+        return;
+    }
+    check_accumulate (accumulate_row_neon);
+    check_blend (blend_span_neon);
+}
+#endif
+
+int main (int argc, char *argv[])
+{
+    g_test_init (&argc, &argv, NULL);
+    g_test_add_func ("/kernels/blend-exact", test_blend_exact);
+#ifdef USE_SSE2
+    g_test_add_func ("/kernels/sse2", test_sse2);
+#endif
+#ifdef USE_NEON
+    g_test_add_func ("/kernels/neon", test_neon);
+#endif
+    return g_test_run ();
+}
+
+/* End of file                                                                */
+/*----------------------------------------------------------------------------*/
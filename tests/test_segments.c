@@ -0,0 +1,394 @@
+/*============================================================================
+Tests for segmented downloads - how a download is split into ranges, how much
+of the file counts as received while its segments are incomplete, and what a
+failed download leaves behind to resume from
+============================================================================*/
+
+#define main rp_bookshelf_main
+#include "rp_bookshelf.c"
+#undef main
+
+#define TOTAL       4000
+#define ETAG        "\"5f3a-1c2b\""
+
+static char *dir, *file_path, *curl_path, *journal_path;
+static guint8 content[TOTAL];
+static tf_status last_status;
+
+/* Helpers                                                                    */
+/*----------------------------------------------------------------------------*/
+
+/* new_download - a transfer part-way into a download of the test content, as header_func would leave it */
+
+static transfer_t *new_download (curl_off_t total, int flags)
+{
+    transfer_t *xfer = g_new0 (transfer_t, 1);
+
+    xfer->url = g_strdup ("https://example.com/pdfs/MagPi92.pdf");
+    xfer->fname = g_strdup (file_path);
+    xfer->tmpname = g_strdup (curl_path);
+    xfer->etag = g_strdup (ETAG);
+    xfer->flags = flags;
+    xfer->downstat = FAILURE;
+    xfer->total = total;
+    xfer->fd = open (curl_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    g_assert_cmpint (xfer->fd, !=, -1);
+    return xfer;
+}
+
+/* free_download - release a download which was never finished, and its segments */
+
+static void free_download (transfer_t *xfer)
+{
+    g_list_free_full (xfer->segments, (GDestroyNotify) free_transfer);
+    close (xfer->fd);
+    free_transfer (xfer);
+}
+
+/* segment - the nth segment of a split download */
+
+static transfer_t *segment (transfer_t *xfer, int n)
+{
+    return g_list_nth_data (xfer->segments, n);
+}
+
+/* feed - pass part of the test content to a download or segment as curl would, from where it has got to */
+
+static void feed (transfer_t *part, curl_off_t len)
+{
+    g_assert_cmpuint (write_func ((char *) content + part->pos, 1, len, part), ==, len);
+}
+
+/* expect_hash - have a download check its file against the SHA-256 of the first len bytes of the test content */
+
+static void expect_hash (transfer_t *xfer, gsize len)
+{
+    xfer->hash = g_compute_checksum_for_data (G_CHECKSUM_SHA256, content, len);
+    xfer->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+}
+
+/* capture_status - termination function recording how the download ended */
+
+static void capture_status (tf_status success, gpointer data)
+{
+    last_status = success;
+}
+
+/* finish - end a download the way check_transfers would */
+
+static void finish (transfer_t *xfer, tf_status status)
+{
+    xfer->downstat = status;
+    xfer->term_fn = capture_status;
+    last_status = CANCELLED;
+    active_xfers = g_list_append (active_xfers, xfer);
+    finish_curl_download (xfer);
+    g_assert_null (active_xfers);
+}
+
+/* Tests                                                                      */
+/*----------------------------------------------------------------------------*/
+
+static void test_split (void)
+{
+    transfer_t *xfer, *seg;
+    curl_off_t start, step;
+    char *range;
+    int i;
+
+    // from the start, and from part-way through a resumed download
+    for (start = 0; start <= 1001; start += 1001)
+    {
+        xfer = new_download (TOTAL, XFER_SEGMENTED);
+        xfer->pos = xfer->offset = start;
+        split_transfer (xfer, SEGMENTS);
+
+        step = (TOTAL - start) / SEGMENTS;
+        g_assert_cmpuint (g_list_length (xfer->segments), ==, SEGMENTS - 1);
+        g_assert_cmpint (xfer->end, ==, start + step);
+        for (i = 0; i < SEGMENTS - 1; i++)
+        {
+            // each range starts where the last stops, and the last runs to the end of the file
+            seg = segment (xfer, i);
+            g_assert_true (seg->parent == xfer);
+            g_assert_cmpint (seg->offset, ==, i ? segment (xfer, i - 1)->end : xfer->end);
+            g_assert_cmpint (seg->pos, ==, seg->offset);
+            g_assert_cmpint (seg->end, ==, i == SEGMENTS - 2 ? TOTAL : seg->offset + step);
+            range = g_strdup_printf ("%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, seg->offset, seg->end - 1);
+            g_assert_cmpstr (seg->range, ==, range);
+            g_free (range);
+            g_assert_cmpstr (seg->headers->data, ==, "If-Range: " ETAG);
+        }
+        free_download (xfer);
+    }
+}
+
+static void test_split_needs_validator (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED);
+
+    // with only a weak ETag there is nothing to stop the parts coming from different versions of the file
+    g_free (xfer->etag);
+    xfer->etag = g_strdup ("W/" ETAG);
+    split_transfer (xfer, SEGMENTS);
+    g_assert_null (xfer->segments);
+    g_assert_cmpint (xfer->end, ==, 0);
+
+    xfer->lastmod = g_strdup ("Wed, 21 Oct 2026 07:28:00 GMT");
+    split_transfer (xfer, SEGMENTS);
+    g_assert_cmpuint (g_list_length (xfer->segments), ==, SEGMENTS - 1);
+    g_assert_cmpstr (segment (xfer, 0)->headers->data, ==, "If-Range: Wed, 21 Oct 2026 07:28:00 GMT");
+    free_download (xfer);
+}
+
+static void test_connections (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED);
+
+    // every segment still fetching holds a connection, and counts against the transfer limit with its download
+    split_transfer (xfer, SEGMENTS);
+    active_xfers = g_list_append (active_xfers, xfer);
+    g_assert_cmpint (transfer_connections (), ==, SEGMENTS);
+    segment (xfer, 1)->done = TRUE;
+    g_assert_cmpint (transfer_connections (), ==, SEGMENTS - 1);
+
+    active_xfers = g_list_remove (active_xfers, xfer);
+    g_assert_cmpint (transfer_connections (), ==, 0);
+    free_download (xfer);
+}
+
+static void test_contiguous (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED);
+    char *data;
+    gsize len;
+
+    split_transfer (xfer, SEGMENTS);
+    g_assert_cmpint (contiguous_bytes (xfer), ==, 0);
+
+    // the first part on its own
+    feed (xfer, 500);
+    g_assert_cmpint (contiguous_bytes (xfer), ==, 500);
+
+    // a later segment finishing first counts for nothing while there is a gap before it
+    feed (segment (xfer, 1), 1000);
+    feed (segment (xfer, 0), 300);
+    g_assert_cmpint (contiguous_bytes (xfer), ==, 500);
+
+    // filling the first part runs on into the incomplete segment after it
+    feed (xfer, 500);
+    g_assert_cmpint (contiguous_bytes (xfer), ==, 1300);
+
+    // and completing that runs on through the one already finished, into the last
+    feed (segment (xfer, 2), 200);
+    feed (segment (xfer, 0), 700);
+    g_assert_cmpint (contiguous_bytes (xfer), ==, 3200);
+
+    feed (segment (xfer, 2), 800);
+    g_assert_cmpint (contiguous_bytes (xfer), ==, TOTAL);
+
+    // every part landed at its own place in the file
+    g_assert_true (g_file_get_contents (curl_path, &data, &len, NULL));
+    g_assert_cmpmem (data, len, content, TOTAL);
+    g_free (data);
+    free_download (xfer);
+}
+
+static void test_write_stops_at_end (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED);
+
+    // a part which runs into the next is cut short, which ends its request
+    split_transfer (xfer, SEGMENTS);
+    g_assert_cmpuint (write_func ((char *) content, 1, 1200, xfer), ==, 1000);
+    g_assert_cmpint (xfer->pos, ==, xfer->end);
+    g_assert_cmpuint (write_func ((char *) content + 1000, 1, 10, xfer), ==, 0);
+    free_download (xfer);
+}
+
+static void test_partial_failure (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED | XFER_RESUMABLE);
+    GKeyFile *kf;
+    char *etag;
+
+    // the first part, some of the second, all of the third and the start of the fourth arrived before it failed
+    split_transfer (xfer, SEGMENTS);
+    feed (xfer, 1000);
+    feed (segment (xfer, 0), 300);
+    feed (segment (xfer, 1), 1000);
+    feed (segment (xfer, 2), 20);
+    finish (xfer, FAILURE);
+    g_assert_cmpint (last_status, ==, FAILURE);
+
+    // only what runs unbroken from the start is recorded
+    g_assert_true (g_file_test (curl_path, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (file_path, G_FILE_TEST_EXISTS));
+    kf = g_key_file_new ();
+    g_assert_true (g_key_file_load_from_file (kf, journal_path, G_KEY_FILE_NONE, NULL));
+    g_assert_cmpint (g_key_file_get_int64 (kf, "Journal", "Bytes", NULL), ==, 1300);
+    etag = g_key_file_get_string (kf, "Journal", "ETag", NULL);
+    g_assert_cmpstr (etag, ==, ETAG);
+    g_free (etag);
+    g_key_file_free (kf);
+
+    // the next attempt cuts the file back to that, and asks for the rest only if the file is unchanged
+    xfer = g_new0 (transfer_t, 1);
+    xfer->url = g_strdup ("https://example.com/pdfs/MagPi92.pdf");
+    xfer->fname = g_strdup (file_path);
+    xfer->tmpname = g_strdup (curl_path);
+    xfer->fd = -1;
+    g_assert_cmpint (load_journal (xfer), ==, 1300);
+    g_assert_cmpint (file_size (curl_path), ==, 1300);
+    g_assert_cmpstr (xfer->headers->data, ==, "If-Range: " ETAG);
+    free_transfer (xfer);
+    remove (journal_path);
+    remove (curl_path);
+}
+
+static void test_failure_with_gap_at_start (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED | XFER_RESUMABLE);
+
+    // the later parts are no use without the first, so there is nothing to resume
+    split_transfer (xfer, SEGMENTS);
+    feed (segment (xfer, 0), 1000);
+    feed (segment (xfer, 1), 1000);
+    finish (xfer, FAILURE);
+    g_assert_cmpint (last_status, ==, FAILURE);
+    g_assert_false (g_file_test (curl_path, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (journal_path, G_FILE_TEST_EXISTS));
+}
+
+static void test_success (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED | XFER_RESUMABLE);
+    char *data;
+    gsize len;
+
+    split_transfer (xfer, SEGMENTS);
+    feed (segment (xfer, 2), 1000);
+    feed (segment (xfer, 0), 1000);
+    feed (xfer, 1000);
+    feed (segment (xfer, 1), 1000);
+    finish (xfer, SUCCESS);
+    g_assert_cmpint (last_status, ==, SUCCESS);
+
+    g_assert_false (g_file_test (curl_path, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (journal_path, G_FILE_TEST_EXISTS));
+    g_assert_true (g_file_get_contents (file_path, &data, &len, NULL));
+    g_assert_cmpmem (data, len, content, TOTAL);
+    g_free (data);
+    remove (file_path);
+}
+
+static void test_checksum_in_order (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED | XFER_RESUMABLE);
+
+    // each part arrives just as the one before it completes, so all of it is hashed straight from curl's buffers
+    expect_hash (xfer, TOTAL);
+    split_transfer (xfer, SEGMENTS);
+    feed (xfer, 1000);
+    feed (segment (xfer, 0), 1000);
+    feed (segment (xfer, 1), 1000);
+    feed (segment (xfer, 2), 1000);
+    g_assert_cmpint (xfer->hashed, ==, TOTAL);
+    finish (xfer, SUCCESS);
+    g_assert_cmpint (last_status, ==, SUCCESS);
+    g_assert_true (g_file_test (file_path, G_FILE_TEST_EXISTS));
+    remove (file_path);
+}
+
+static void test_checksum_out_of_order (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED | XFER_RESUMABLE);
+
+    // the later parts finish first, so the hash has to read them back from the file
+    expect_hash (xfer, TOTAL);
+    split_transfer (xfer, SEGMENTS);
+    feed (segment (xfer, 2), 1000);
+    feed (segment (xfer, 0), 600);
+    feed (xfer, 1000);
+    g_assert_cmpint (xfer->hashed, ==, 1600);
+    feed (segment (xfer, 1), 1000);
+    feed (segment (xfer, 0), 400);
+    finish (xfer, SUCCESS);
+    g_assert_cmpint (last_status, ==, SUCCESS);
+    g_assert_true (g_file_test (file_path, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (curl_path, G_FILE_TEST_EXISTS));
+    remove (file_path);
+}
+
+static void test_checksum_mismatch (void)
+{
+    transfer_t *xfer = new_download (TOTAL, XFER_SEGMENTED | XFER_RESUMABLE);
+
+    // a file which does not match is dropped entirely, rather than kept to resume
+    expect_hash (xfer, TOTAL - 1);
+    split_transfer (xfer, SEGMENTS);
+    feed (xfer, 1000);
+    feed (segment (xfer, 0), 1000);
+    feed (segment (xfer, 1), 1000);
+    feed (segment (xfer, 2), 1000);
+    g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "checksum mismatch*");
+    finish (xfer, SUCCESS);
+    g_test_assert_expected_messages ();
+    g_assert_cmpint (last_status, ==, FAILURE);
+    g_assert_false (g_file_test (file_path, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (curl_path, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (journal_path, G_FILE_TEST_EXISTS));
+}
+
+static void test_checksum_short (void)
+{
+    transfer_t *xfer = new_download (TOTAL, 0);
+
+    // the checksum of what arrived is right, but not all of the file did
+    expect_hash (xfer, 3000);
+    feed (xfer, 3000);
+    g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "checksum mismatch*");
+    finish (xfer, SUCCESS);
+    g_test_assert_expected_messages ();
+    g_assert_cmpint (last_status, ==, FAILURE);
+    g_assert_false (g_file_test (file_path, G_FILE_TEST_EXISTS));
+}
+
+int main (int argc, char *argv[])
+{
+    int i, res;
+
+    dir = g_dir_make_tmp ("bookshelf-test-XXXXXX", NULL);
+    g_assert_nonnull (dir);
+    g_setenv ("HOME", dir, TRUE);
+    file_path = g_build_filename (dir, "MagPi92.pdf", NULL);
+    curl_path = g_strdup_printf ("%s.curl", file_path);
+    journal_path = g_strdup_printf ("%s.journal", file_path);
+    max_transfers = MAX_TRANSFERS;
+    max_segments = SEGMENTS;
+
+    g_test_init (&argc, &argv, NULL);
+    for (i = 0; i < TOTAL; i++) content[i] = g_random_int_range (0, 256);
+    g_test_add_func ("/segments/split", test_split);
+    g_test_add_func ("/segments/split-needs-validator", test_split_needs_validator);
+    g_test_add_func ("/segments/connections", test_connections);
+    g_test_add_func ("/segments/contiguous", test_contiguous);
+    g_test_add_func ("/segments/write-stops-at-end", test_write_stops_at_end);
+    g_test_add_func ("/segments/partial-failure", test_partial_failure);
+    g_test_add_func ("/segments/failure-with-gap-at-start", test_failure_with_gap_at_start);
+    g_test_add_func ("/segments/success", test_success);
+    g_test_add_func ("/segments/checksum-in-order", test_checksum_in_order);
+    g_test_add_func ("/segments/checksum-out-of-order", test_checksum_out_of_order);
+    g_test_add_func ("/segments/checksum-mismatch", test_checksum_mismatch);
+    g_test_add_func ("/segments/checksum-short", test_checksum_short);
+    res = g_test_run ();
+
+    remove (journal_path);
+    remove (curl_path);
+    remove (file_path);
+    g_rmdir (dir);
+    return res;
+}
+
+/* End of file                                                                */
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,242 @@
+/*============================================================================
+Tests for the catalogue snapshot - a snapshot which no longer matches its XML,
+or which has been damaged, must be ignored and the XML parsed instead
+============================================================================*/
+
+#define main rp_bookshelf_main
+#include "rp_bookshelf.c"
+#undef main
+
+static const char fixture[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<PUBS>\n"
+    "  <MAGPI>\n"
+    "    <ITEM>\n"
+    "      <TITLE>Issue 92</TITLE>\n"
+    "      <DESC>Raspberry Pi problems solved &amp; more</DESC>\n"
+    "      <COVER>https://example.com/covers/92.jpg?1</COVER>\n"
+    "      <PDF>https://example.com/pdfs/MagPi92.pdf?1</PDF>\n"
+    "      <HASH>0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef</HASH>\n"
+    "    </ITEM>\n"
+    "    <ITEM>\n"
+    "      <TITLE>Issue 91</TITLE>\n"
+    "      <DESC>#MonthOfMaking</DESC>\n"
+    "      <COVER>https://example.com/covers/91.jpg?1</COVER>\n"
+    "      <PDF>https://example.com/pdfs/MagPi91.pdf?1</PDF>\n"
+    "    </ITEM>\n"
+    "  </MAGPI>\n"
+    "  <BOOKS>\n"
+    "    <ITEM>\n"
+    "      <TITLE>Book of Making</TITLE>\n"
+    "      <DESC>For contributors</DESC>\n"
+    "      <COVER>https://example.com/covers/making.jpg</COVER>\n"
+    "      <FILE>making.pdf</FILE>\n"
+    "    </ITEM>\n"
+    "  </BOOKS>\n"
+    "</PUBS>\n";
+
+static char *xml_path, *snap_path;
+static GHashTable *no_files;
+
+/* Helpers                                                                    */
+/*----------------------------------------------------------------------------*/
+
+/* check_same - assert that two catalogues hold the same items in the same order */
+
+static void check_same (catalogue_t *a, catalogue_t *b)
+{
+    item_t *ia, *ib;
+    int i;
+
+    g_assert_nonnull (a);
+    g_assert_nonnull (b);
+    g_assert_cmpuint (a->items->len, ==, b->items->len);
+    for (i = 0; i < a->items->len; i++)
+    {
+        ia = &g_array_index (a->items, item_t, i);
+        ib = &g_array_index (b->items, item_t, i);
+        g_assert_cmpint (ia->category, ==, ib->category);
+        g_assert_cmpint (ia->downloaded, ==, ib->downloaded);
+        g_assert_cmpstr (ia->title, ==, ib->title);
+        g_assert_cmpstr (ia->desc, ==, ib->desc);
+        g_assert_cmpstr (ia->pdfpath, ==, ib->pdfpath);
+        g_assert_cmpstr (ia->covpath, ==, ib->covpath);
+        g_assert_cmpstr (ia->hash, ==, ib->hash);
+    }
+}
+
+/* patch_snapshot - overwrite bytes of the snapshot at an offset */
+
+static void patch_snapshot (goffset offset, const void *data, gsize len)
+{
+    int fd = open (snap_path, O_WRONLY);
+
+    g_assert_cmpint (fd, !=, -1);
+    g_assert_cmpint (pwrite (fd, data, len, offset), ==, len);
+    close (fd);
+}
+
+/* fresh_snapshot - parse the fixture and write a good snapshot for it; returns the parsed catalogue */
+
+static catalogue_t *fresh_snapshot (void)
+{
+    catalogue_t *cat;
+
+    g_assert_true (g_file_set_contents (xml_path, fixture, -1, NULL));
+    cat = parse_catalogue (xml_path, no_files);
+    g_assert_nonnull (cat);
+    g_assert_cmpuint (cat->items->len, ==, 3);
+    write_snapshot (xml_path, cat);
+    g_assert_true (g_file_test (snap_path, G_FILE_TEST_EXISTS));
+    return cat;
+}
+
+/* check_fallback - the damaged snapshot is refused, the XML is parsed in its place, and a good snapshot written again */
+
+static void check_fallback (catalogue_t *ref)
+{
+    catalogue_t *cat;
+
+    g_assert_null (load_snapshot (xml_path, no_files));
+    g_assert_null (read_catalogue (xml_path, READ_PRELOAD, no_files));
+
+    cat = read_catalogue (xml_path, READ_CACHED, no_files);
+    check_same (ref, cat);
+    free_catalogue (cat);
+
+    cat = load_snapshot (xml_path, no_files);
+    check_same (ref, cat);
+    free_catalogue (cat);
+}
+
+/* Tests                                                                      */
+/*----------------------------------------------------------------------------*/
+
+static void test_round_trip (void)
+{
+    catalogue_t *ref, *cat;
+
+    ref = fresh_snapshot ();
+    cat = load_snapshot (xml_path, no_files);
+    check_same (ref, cat);
+    free_catalogue (cat);
+
+    cat = read_catalogue (xml_path, READ_PRELOAD, no_files);
+    check_same (ref, cat);
+    free_catalogue (cat);
+    free_catalogue (ref);
+}
+
+static void test_truncated (void)
+{
+    catalogue_t *ref = fresh_snapshot ();
+
+    g_assert_cmpint (truncate (snap_path, sizeof (snap_header_t) + sizeof (snap_item_t)), ==, 0);
+    check_fallback (ref);
+    free_catalogue (ref);
+}
+
+static void test_bad_header (void)
+{
+    catalogue_t *ref = fresh_snapshot ();
+    guint32 val = SNAP_VERSION + 1;
+
+    patch_snapshot (G_STRUCT_OFFSET (snap_header_t, version), &val, sizeof (val));
+    check_fallback (ref);
+
+    free_catalogue (ref);
+    ref = fresh_snapshot ();
+    val = 0;
+    patch_snapshot (G_STRUCT_OFFSET (snap_header_t, magic), &val, sizeof (val));
+    check_fallback (ref);
+    free_catalogue (ref);
+}
+
+static void test_bad_offset (void)
+{
+    catalogue_t *ref = fresh_snapshot ();
+    guint32 val = G_MAXUINT32;
+
+    patch_snapshot (sizeof (snap_header_t) + sizeof (snap_item_t) + G_STRUCT_OFFSET (snap_item_t, title), &val, sizeof (val));
+    check_fallback (ref);
+    free_catalogue (ref);
+}
+
+static void test_unterminated (void)
+{
+    catalogue_t *ref = fresh_snapshot ();
+    goffset size;
+    char c = 'x';
+
+    file_mtime (snap_path, &size);
+    patch_snapshot (size - 1, &c, 1);
+    check_fallback (ref);
+    free_catalogue (ref);
+}
+
+static void test_xml_changed (void)
+{
+    catalogue_t *ref, *cat;
+    char *edited, *p;
+
+    // same length, different bytes - only the digest can tell
+    ref = fresh_snapshot ();
+    free_catalogue (ref);
+    edited = g_strdup (fixture);
+    p = strstr (edited, "Issue 91");
+    p[7] = '0';
+    g_assert_true (g_file_set_contents (xml_path, edited, -1, NULL));
+    g_assert_null (load_snapshot (xml_path, no_files));
+
+    cat = read_catalogue (xml_path, READ_CACHED, no_files);
+    g_assert_nonnull (cat);
+    g_assert_cmpstr (g_array_index (cat->items, item_t, 1).title, ==, "Issue 90");
+    free_catalogue (cat);
+    g_free (edited);
+}
+
+static void test_xml_touched (void)
+{
+    catalogue_t *ref, *cat;
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { 1, 0 } };
+
+    // a new timestamp on the same bytes keeps the snapshot, which is then rewritten for the new time
+    ref = fresh_snapshot ();
+    g_assert_cmpint (utimensat (AT_FDCWD, xml_path, ts, 0), ==, 0);
+    cat = load_snapshot (xml_path, no_files);
+    check_same (ref, cat);
+    free_catalogue (cat);
+    free_catalogue (ref);
+}
+
+int main (int argc, char *argv[])
+{
+    char *dir;
+    int res;
+
+    // snapshots record the state of the bookshelf in the home dir, so give the tests one of their own
+    dir = g_dir_make_tmp ("bookshelf-test-XXXXXX", NULL);
+    g_assert_nonnull (dir);
+    g_setenv ("HOME", dir, TRUE);
+    xml_path = g_build_filename (dir, "cat.xml", NULL);
+    snap_path = g_strdup_printf ("%s.snap", xml_path);
+    no_files = g_hash_table_new (g_str_hash, g_str_equal);
+
+    g_test_init (&argc, &argv, NULL);
+    g_test_add_func ("/snapshot/round-trip", test_round_trip);
+    g_test_add_func ("/snapshot/truncated", test_truncated);
+    g_test_add_func ("/snapshot/bad-header", test_bad_header);
+    g_test_add_func ("/snapshot/bad-offset", test_bad_offset);
+    g_test_add_func ("/snapshot/unterminated", test_unterminated);
+    g_test_add_func ("/snapshot/xml-changed", test_xml_changed);
+    g_test_add_func ("/snapshot/xml-touched", test_xml_touched);
+    res = g_test_run ();
+
+    remove (snap_path);
+    remove (xml_path);
+    g_rmdir (dir);
+    return res;
+}
+
+/* End of file                                                                */
+/*----------------------------------------------------------------------------*/